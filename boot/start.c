@@ -2,13 +2,19 @@
 #include "param.h"
 #include "mm/memlayout.h"
 #include "riscv.h"
+#include "lib/string.h"
 
 void main();
 void timerinit();
+void ipiinit();
+extern void machinevec();
 
 // entry.S needs one stack per CPU.
 __attribute__((aligned(16))) char stack0[4096 * NCPU];
 
+// machinevec.S 中保存寄存器用的临时空间，每个 hart 一份
+uint64 ipi_scratch[NCPU][2];
+
 // entry.S jumps here in machine mode on stack0.
 void start()
 {
@@ -17,6 +23,11 @@ void start()
   unsigned long x = r_mstatus();
   x &= ~MSTATUS_MPP_MASK;
   x |= MSTATUS_MPP_S;
+  // 有 V 扩展（QEMU -cpu rv64,v=true）时内核大块的 memcpy/memset 用向量指令
+  // 向量单元（VS）保持关闭，只在用的时候临时打开，见 lib/string.c
+  x &= ~MSTATUS_VS_MASK;
+  if (r_misa() & MISA_V)
+    rvv_enabled = 1;
   w_mstatus(x);
 
   // set M Exception Program Counter to main, for mret.
@@ -45,6 +56,9 @@ void start()
   int id = r_mhartid();
   w_tp(id);
 
+  // 核间中断
+  ipiinit();
+
   // switch to supervisor mode and jump to main().
   asm volatile("mret");
 }
@@ -65,3 +79,14 @@ void timerinit()
   // 设置时钟中断发生的间隙，即 1000_000 个节拍发生一次时钟中断
   w_stimecmp(r_time() + 1000000);
 }
+
+// 核间中断（IPI）：内核写目标 hart 的 CLINT msip，目标 hart 进入机器模式的 machinevec，
+// 在那里清掉 msip 并置位 sip.SSIP，转成监管模式的软中断交给内核处理
+void ipiinit()
+{
+  int id = r_mhartid();
+
+  w_mscratch((uint64)ipi_scratch[id]);
+  w_mtvec((uint64)machinevec);
+  w_mie(r_mie() | MIE_MSIE);
+}
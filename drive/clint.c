@@ -0,0 +1,21 @@
+#include "std/stddef.h"
+#include "mm/memlayout.h"
+#include "riscv.h"
+
+//
+// the riscv Core Local Interruptor (CLINT).
+// 我们只用它的 msip 来发送核间中断，时钟中断使用 sstc 扩展的 stimecmp
+//
+
+// 向 hart 发送核间中断，目标 hart 最终会收到一个监管模式软中断（见 boot/machinevec.S）
+void clint_send_ipi(int hart)
+{
+  __sync_synchronize();
+  *(volatile uint32 *)CLINT_MSIP(hart) = 1;
+}
+
+// 在监管模式软中断处理中调用，清掉本 hart 的 sip.SSIP
+void clint_clear_ipi(void)
+{
+  w_sip(r_sip() & ~SIP_SSIP);
+}
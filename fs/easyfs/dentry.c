@@ -64,13 +64,11 @@ static inline void efs_d_addsb(struct easy_dentry *d)
     list_add_head(&d->d_list, &m_esb.s_dlist);
 }
 
-static struct easy_dentry *efs_d_alloc()
+// efs_dentry_kmem_cache 的构造函数，锁和链表只在新建 slab 时初始化一次
+void efs_d_ctor(void *obj)
 {
-    struct easy_dentry *d = kmem_cache_alloc(&efs_dentry_kmem_cache);
-    assert(d != NULL, "efs_d_alloc");
+    struct easy_dentry *d = (struct easy_dentry *)obj;
 
-    d->d_inode = NULL;
-    d->d_parent = NULL;
     INIT_LIST_HEAD(&d->d_child);
     INIT_LIST_HEAD(&d->d_sibling);
 
@@ -80,7 +78,15 @@ static struct easy_dentry *efs_d_alloc()
 
     spin_init(&d->d_lock, "dentry");
     sleep_init(&d->d_slock, "dentry");
+}
 
+static struct easy_dentry *efs_d_alloc()
+{
+    struct easy_dentry *d = kmem_cache_alloc(&efs_dentry_kmem_cache);
+    assert(d != NULL, "efs_d_alloc");
+
+    d->d_inode = NULL;
+    d->d_parent = NULL;
     d->d_flags = 0;
     atomic_set(&d->refcnt, 0);
     return d;
@@ -169,6 +169,7 @@ extern void efs_sb_info();
 // extern void efs_i_fill(struct easy_m_inode *m_inode, int ino);
 // extern struct easy_m_inode * efs_i_alloc(int anonymous);
 // extern void efs_i_del(struct easy_m_inode *inode);
+extern void efs_i_ctor(void *obj);
 extern void efs_i_put(struct easy_m_inode *m_inode);
 // extern void efs_i_update(struct easy_m_inode *inode);
 extern struct easy_m_inode *efs_i_get(int ino);
@@ -189,6 +190,7 @@ extern __attribute__((unused)) void efs_i_info(const struct easy_m_inode *inode)
 extern void efs_i_root_init();
 
 // 4. dentry
+extern void efs_d_ctor(void *obj);
 extern void efs_d_lookup(struct easy_dentry *pd);
 extern struct easy_dentry *efs_d_creat(struct easy_dentry *pd, const char *name, enum easy_file_type type);
 extern void efs_d_unlink(struct easy_dentry *d);
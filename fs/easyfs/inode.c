@@ -16,6 +16,18 @@ static inline int offset_ino(int ino)
     return ino * m_esb.s_ds.inode_size;
 }
 
+// efs_inode_kmem_cache 的构造函数，锁和链表只在新建 slab 时初始化一次
+void efs_i_ctor(void *obj)
+{
+    struct easy_m_inode *m_inode = (struct easy_m_inode *)obj;
+
+    spin_init(&m_inode->i_lock, "i_lock");
+    sleep_init(&m_inode->i_slock, "i_slock");
+    INIT_HASH_NODE(&m_inode->i_hnode);
+    INIT_LIST_HEAD(&m_inode->i_list);
+    INIT_LIST_HEAD(&m_inode->i_dirty);
+}
+
 // 分配 ino 的 inode，是新的
 // 搭配 efs_i_alloc 后 fill
 static struct easy_m_inode *efs_i_alloc()
@@ -25,13 +37,8 @@ static struct easy_m_inode *efs_i_alloc()
         panic("efs_ialloc.\n");
 
     m_inode->i_flags = 0;
-    spin_init(&m_inode->i_lock, "i_lock");
-    sleep_init(&m_inode->i_slock, "i_slock");
     atomic_set(&m_inode->i_refcnt, 0);
     m_inode->i_sb = &m_esb;
-    INIT_HASH_NODE(&m_inode->i_hnode);
-    INIT_LIST_HEAD(&m_inode->i_list);
-    INIT_LIST_HEAD(&m_inode->i_dirty);
     m_inode->i_indir = NULL;
     return m_inode;
 }
@@ -16,7 +16,7 @@ extern void efs_d_cdirty(struct easy_dentry *d);
 static void efs_fill_imap()
 {
     // 这个位图同下 bmap，目前感觉一个块完全够了，理论最大支持 4096 * 8 = 32,768 个文件
-    uint64 *imap_addr = __alloc_page(0);
+    uint64 *imap_addr = __alloc_page(__GFP_ZERO);
     assert(imap_addr != NULL, "efs_fill_imap\n");
     blk_read_count(efs_bd, m_esb.s_ds.inode_map_start, m_esb.s_ds.inode_area_start - m_esb.s_ds.inode_map_start, imap_addr);
     bitmap_init_zone(&imap, imap_addr, m_esb.s_ds.inode_count);
@@ -174,7 +174,7 @@ void efs_sb_init()
 {
     efs_sb_read();
     efs_sb_fill();
-    kthread_create(efs_sync, NULL, "efs_sync",NO_CPU_AFF);
+    kthread_create_rt(efs_sync, NULL, "efs_sync", NO_CPU_AFF, SCHED_RR, KTHREAD_PRIO_FLUSH);
 }
 
 // 上面的函数都是初始化时使用，内核中已经确保不需要加锁。
@@ -17,6 +17,8 @@
 
 #endif
 
+#define NO_HZ // 空闲或者只有一个可运行线程时停掉周期时钟，按最近的定时器编程 stimecmp
+
 #define MAX_PATH_LEN 256     // 支持最长路径长度
 #define ARG_MAX (128 * 1024) // 传入参数最长 128K
 #define ENV_MAX (128 * 1024) // 环境变量最长 128K
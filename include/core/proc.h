@@ -46,6 +46,10 @@ struct cpu
   struct thread_info *thread;
   struct thread_info *idle;
   struct sched_struct sched_list; // 每个CPU的进程调用链
+  volatile int is_idle;           // 调度器是否在 wfi 中等待，唤醒线程时据此决定是否发送核间中断
+  volatile int tick_stopped;      // NO_HZ：周期时钟是否已停，入队线程时需要重新打开
+  struct thread_info *prev;       // 刚被切换出去、锁还没释放的线程，由切换后的一方释放
+  volatile int need_resched;      // 有更高优先级的线程入队，中断返回前让出 CPU
 };
 extern struct cpu cpus[NCPU];
 
@@ -120,7 +124,20 @@ struct thread_info
   uint32 flags;
   enum task_state state;
   pid_t pid;
-  uint64 ticks;
+
+  // 调度相关，见 sched.h
+  int policy;
+  int prio;                // 实时线程（SCHED_FIFO/SCHED_RR）的固定优先级
+  int nice;                // SCHED_NORMAL 的 nice 值
+  uint32 weight;           // 由 nice 得到的权重
+  uint64 vruntime;         // 虚拟运行时间，不在 CPU 上时为相对 min_vruntime 的偏移
+  uint64 exec_start;       // 上次记账的时间
+  uint64 slice_start;      // 本次上处理机的时间
+  uint64 sum_exec_runtime; // 累计运行时间
+  int last_cpu;            // 上次运行的 CPU，还没运行过为 -1
+  uint64 last_ran;         // 上次下处理机的时间，用来估计缓存是否还热
+  uint64 enqueue_time;     // 进入就绪队列的时间，统计等待时间用
+  struct rb_node run_node; // 公平调度红黑树节点
 
   // wait_lock must be held when using this:
   struct thread_info *parent; // 父进程指针
@@ -143,6 +160,8 @@ extern struct cpu *mycpu();
 extern struct thread_info *myproc(void);
 extern struct thread_info *alloc_kthread();
 extern struct thread_info *alloc_uthread();
+extern void free_thread(struct thread_info *thread);
+extern void reap_zombies(struct cpu *cpu);
 
 #define Kernel_stack_top(t) ((uint64)t + 2 * PGSIZE - 16)
 
@@ -3,27 +3,100 @@
 
 #include "lib/spinlock.h"
 #include "lib/list.h"
+#include "lib/rbtree.h"
 
 struct thread_info;
 
+// 调度策略
+#define SCHED_NORMAL 0 // 公平调度，按 vruntime 排在红黑树中
+#define SCHED_FIFO 1   // 实时，固定优先级，排在优先级数组中，总是先于公平调度的线程，一直运行到睡眠或被更高优先级抢占
+#define SCHED_RR 2     // 实时，同 SCHED_FIFO，但同优先级的线程之间按 SCHED_RR_TIMESLICE 轮转
+
+// 固定优先级，数值越小优先级越高
+#define MAX_PRIO 32
+#define DEFAULT_PRIO 16
+
+// 内核实时线程的优先级
+#define KTHREAD_PRIO_IO 4     // 磁盘请求处理，完成越快等 IO 的线程越早醒来
+#define KTHREAD_PRIO_WORK 8   // 每个 CPU 的工作队列
+#define KTHREAD_PRIO_FLUSH 12 // 周期回写
+
+// 公平调度的 nice 值，nice 为 0 时权重为 NICE_0_WEIGHT
+#define MIN_NICE -20
+#define MAX_NICE 19
+#define NICE_0_WEIGHT 1024
+
+// 时间单位为 time 寄存器的节拍（qemu virt 上为 10MHz）
+// 一个调度周期内所有可运行的线程按权重分完，每个线程至少运行 SCHED_MIN_GRANULARITY
+#define SCHED_LATENCY 1000000       // 100ms
+#define SCHED_MIN_GRANULARITY 250000 // 25ms，即一次时钟中断
+// 线程下处理机后这么久之内认为它的缓存还是热的，负载均衡时尽量不迁移
+#define SCHED_MIGRATION_COST 5000    // 0.5ms
+
+// SCHED_RR 的时间片
+#define SCHED_RR_TIMESLICE 1000000 // 100ms
+// 实时线程限流：每个 SCHED_RT_PERIOD 内，一个 CPU 上的实时线程最多运行 SCHED_RT_RUNTIME，
+// 剩下的时间留给公平调度的线程，防止失控的实时线程锁死 CPU
+#define SCHED_RT_PERIOD 10000000 // 1s
+#define SCHED_RT_RUNTIME 9500000 // 0.95s
+
+// 优先级数组，每个优先级一个就绪队列，bitmap 记录哪些队列非空
+// 只有 RUNNABLE 的线程才会在队列中，选择下一个线程只需找到最低的置位
+struct prio_array
+{
+    uint32 bitmap;
+    struct list_head queue[MAX_PRIO];
+};
+
+// 就绪队列等待时间直方图的桶：<10us, <100us, <1ms, <10ms, <100ms, 更长
+#define SCHED_WAIT_BUCKETS 6
+
+// 每个 CPU 的调度统计，只由本 CPU 在关中断时更新，读取时不加锁
+struct sched_stats
+{
+    uint64 nr_switches;    // 上下文切换次数
+    uint64 nr_voluntary;   // 睡眠、退出主动让出
+    uint64 nr_involuntary; // 时间片用完被抢占
+    uint64 nr_migrations;  // 在本 CPU 上运行的线程上次不在本 CPU
+    uint64 idle_time;      // 在 wfi 中空等的时间
+    uint64 wait_hist[SCHED_WAIT_BUCKETS]; // 从入队到上处理机的等待时间
+    uint64 wait_max;
+};
+
 struct sched_struct
 {
     spinlock_t lock;
-    struct list_head run;
+    struct prio_array run;       // 固定优先级的线程
+    struct rb_root_cached fair;  // 公平调度的线程，按 vruntime 排序
+    uint64 min_vruntime;         // 公平调度队列的 vruntime 基准，只增不减
+    uint64 load;                 // 树中线程的权重之和
     struct list_head out;
+    int nr_running; // 就绪队列中线程数，用于负载均衡（可不加锁读取）
+    int curr_prio;    // 正在运行的线程的优先级，公平调度的为 MAX_PRIO，唤醒抢占时不加锁读取
+    uint64 rt_time;   // 本周期内实时线程已经运行的时间
+    uint64 rt_period_start;
+    int rt_throttled; // 实时线程用完了本周期的配额
+    struct sched_stats stats;
 };
 
 #define NO_CPU_AFF -1
 
 extern void sched();
 extern void yield();
+extern void finish_task_switch();
 extern void scheduler();
+extern int sched_tick(struct thread_info *curr);
+extern void sched_set_nice(struct thread_info *thread, int nice);
+extern int sched_setscheduler(struct thread_info *thread, int policy, int prio);
 
 extern void sched_init();
 extern void user_init();
 // extern void user_init2();
 extern void wakeup_process(struct thread_info *thread);
 extern void kthread_create(void (*func)(void *), void *args, const char *name, int cpu_affinity);
+extern void kthread_create_rt(void (*func)(void *), void *args, const char *name, int cpu_affinity, int policy, int prio);
 extern void debug_cpu_shed_list() __attribute__((unused));
+extern void sched_stats_show();
+extern void sched_stats_reset();
 
 #endif
\ No newline at end of file
@@ -4,6 +4,9 @@
 // System call numbers
 
 #define SYS_debug 0
+// sys_debug 的子命令（a0）
+#define DEBUG_SCHED_STATS 1 // 打印各 CPU 的调度统计
+#define DEBUG_SCHED_RESET 2 // 清零调度统计
 
 #define SYS_fork    1
 #define SYS_exit    2
@@ -5,6 +5,11 @@
 #include "core/proc.h"
 typedef uint64 ticks_t;
 
+// 一个 tick 对应的 time 寄存器节拍数（qemu virt 上为 10MHz，即 25ms），也是周期时钟中断的间隔
+#define TICK_INTERVAL 250000
+// NO_HZ 时最长多久不来时钟中断
+#define NOHZ_MAX_IDLE (40 * TICK_INTERVAL)
+
 typedef struct timer
 {
     void (*callback)(void *); // 回调函数
@@ -26,4 +31,6 @@ extern void time_update();
 extern ticks_t get_cur_time();
 extern timer_t *timer_create(void (*callback)(void *), void *args, uint64 during_time, int count, int is_block);
 extern void thread_timer_sleep(struct thread_info *thread, uint64 down_time);
+extern int tick_nohz_stop();
+extern void tick_restart();
 #endif
\ No newline at end of file
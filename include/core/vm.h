@@ -28,6 +28,7 @@ struct vm_area_struct
 struct mm_struct
 {
     pagetable_t pgd;
+    uint64 context; // 高位是 ASID 的代（generation），低 asid_bits 位是 ASID，0 表示还没分配过
 
     uint64 start_code;
     uint64 end_code;
@@ -54,8 +55,12 @@ struct vm_operations_struct
 
 extern void kvm_init();
 extern void kvm_init_hart();
+extern void switch_mm(struct mm_struct *mm);
 extern pagetable_t alloc_pgt();
 
 extern void uvmfirst(struct thread_info *init, uchar *src, uint sz);
+extern int uvm_cow_copy(struct mm_struct *old, struct mm_struct *new);
+extern void uvm_free(struct mm_struct *mm);
+extern void page_fault_handler(uint64 fault_addr, uint64 scause);
 
 #endif
\ No newline at end of file
@@ -57,6 +57,7 @@ struct bhash_struct
 };
 
 extern void bhash_init(struct bhash_struct *bhash, struct gendisk *gd);
+extern void buf_ctor(void *obj);
 
 extern struct buf_head *buf_get(struct gendisk *gd, uint blockno);
 
@@ -0,0 +1,7 @@
+#ifndef __CLINT_H__
+#define __CLINT_H__
+
+void clint_send_ipi(int hart);
+void clint_clear_ipi(void);
+
+#endif
@@ -25,6 +25,7 @@ struct file
     mutex_t f_mutex;    // 读写互斥操作
 };
 
+extern void file_ctor(void *obj);
 extern struct file *file_dup(struct file *f);
 extern struct file *file_open(const char *file_path, flags_t flags);
 extern void file_close(struct file *f);
@@ -44,6 +44,18 @@ static inline void atomic_dec(atomic_t *v)
     atomic_sub(1, v);
 }
 
+// 自减，返回新值
+static inline int atomic_dec_return(atomic_t *v)
+{
+    int old;
+    __asm__ __volatile__(
+        "amoadd.w %0, %2, (%1)"
+        : "=r"(old)
+        : "r"(&(v->counter)), "r"(-1)
+        : "memory");
+    return old - 1;
+}
+
 static inline int atomic_dec_and_test(atomic_t *v)
 {
     int old;
@@ -5,4 +5,16 @@ extern uint64 next_power_of_2(uint64 n);
 extern uint32 calculate_order(uint32 size);
 extern uint32 math_log(uint32 num, uint16 base);
 extern uint32 math_pow(uint32 base, uint16 exponent);
+
+// 返回 x 最低的置 1 位的下标，x 不能为 0
+// 不用 __builtin_ctz，没有 Zbb 扩展时它会调用 libgcc，而我们不链接 libgcc
+static inline int first_set_bit(uint64 x)
+{
+    static const uint8 debruijn_index[64] = {
+        0, 1, 2, 53, 3, 7, 54, 27, 4, 38, 41, 8, 34, 55, 48, 28,
+        62, 5, 39, 46, 44, 42, 22, 9, 24, 35, 59, 56, 49, 18, 29, 11,
+        63, 52, 6, 26, 37, 40, 33, 47, 61, 45, 43, 21, 23, 58, 17, 10,
+        51, 25, 36, 32, 60, 20, 57, 16, 50, 31, 19, 15, 30, 14, 13, 12};
+    return debruijn_index[((x & -x) * 0x022fdd63cc95386dUL) >> 58];
+}
 #endif
\ No newline at end of file
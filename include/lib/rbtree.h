@@ -1,40 +1,78 @@
-// #ifndef __RBTREE_H__
-// #define __RBTREE_H__
-// #include "std/stddef.h"
-
-// typedef struct rb_node
-// {
-//     char color;
-//     struct rb_node *left;
-//     struct rb_node *right;
-//     struct rb_node *parent;
-// } rb_node;
-
-// typedef struct rb_tree rb_tree;
-
-
-// // arg 传递给所有操作函数的附加参数这可以让调用者向各种操作函数传递额外的上下文信息。
-// // 例如，在比较、合并、分配或释放节点时，可能需要一些额外的上下文（如自定义配置、状态等）。
-
-// /* Support functions to be provided by caller */
-// typedef int (*rbt_comparator)(const rb_node *a, const rb_node *b, void *arg);
-// typedef void (*rbt_combiner)(rb_node *existing, const rb_node *newdata, void *arg);
-// typedef rb_node *(*rbt_allocfunc)(void *arg);
-// typedef void (*rbt_freefunc)(rb_node *x, void *arg);
-
-// extern rb_tree *rbt_create(uint16 node_size,
-//                           rbt_comparator comparator,
-//                           rbt_combiner combiner,
-//                           rbt_allocfunc allocfunc,
-//                           rbt_freefunc freefunc,
-//                           void *arg);
-
-// extern rb_node *rbt_find(rb_tree *rbt, const rb_node *data);
-// extern rb_node *rbt_find_great(rb_tree *rbt, const rb_node *data, int equal_match);
-// extern rb_node *rbt_find_less(rb_tree *rbt, const rb_node *data, int equal_match);
-// extern rb_node *rbt_leftmost(rb_tree *rbt);
-
-// extern rb_node *rbt_insert(rb_tree *rbt, const rb_node *data, int *isNew);
-// extern void rbt_delete(rb_tree *rbt, rb_node *node);
-
-// #endif
\ No newline at end of file
+#ifndef __RBTREE_H__
+#define __RBTREE_H__
+#include "std/stddef.h"
+
+// 侵入式红黑树，用法与链表类似：把 rb_node 嵌入到自己的结构体中
+// 插入时调用者自己查找位置（比较逻辑由调用者决定），然后 rb_link_node + rb_insert_color
+// 树本身不加锁，调用者负责互斥
+
+#define RB_RED 0
+#define RB_BLACK 1
+
+struct rb_node
+{
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    int color;
+};
+
+struct rb_root
+{
+    struct rb_node *node;
+};
+
+// 额外缓存最左（最小）节点，取最小值 O(1)
+struct rb_root_cached
+{
+    struct rb_root root;
+    struct rb_node *leftmost;
+};
+
+#define RB_ROOT ((struct rb_root){NULL})
+#define RB_ROOT_CACHED ((struct rb_root_cached){{NULL}, NULL})
+
+#define rb_entry(ptr, type, member) \
+    container_of(ptr, type, member)
+
+#define RB_EMPTY_ROOT(root) ((root)->node == NULL)
+
+// 节点不在任何树中时 parent 指向自己
+#define RB_EMPTY_NODE(n) ((n)->parent == (n))
+#define RB_CLEAR_NODE(n) ((n)->parent = (n))
+
+// 把新节点挂在 parent 的 link（&parent->left 或 &parent->right）上，之后需要 rb_insert_color
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent, struct rb_node **link)
+{
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->color = RB_RED;
+    *link = node;
+}
+
+extern void rb_insert_color(struct rb_node *node, struct rb_root *root);
+extern void rb_erase(struct rb_node *node, struct rb_root *root);
+
+extern struct rb_node *rb_first(const struct rb_root *root);
+extern struct rb_node *rb_last(const struct rb_root *root);
+extern struct rb_node *rb_next(const struct rb_node *node);
+extern struct rb_node *rb_prev(const struct rb_node *node);
+
+// leftmost 表示新节点插入时一直往左走，即它是新的最小节点
+static inline void rb_insert_color_cached(struct rb_node *node, struct rb_root_cached *root, int leftmost)
+{
+    if (leftmost)
+        root->leftmost = node;
+    rb_insert_color(node, &root->root);
+}
+
+static inline void rb_erase_cached(struct rb_node *node, struct rb_root_cached *root)
+{
+    if (root->leftmost == node)
+        root->leftmost = rb_next(node);
+    rb_erase(node, &root->root);
+}
+
+#define rb_first_cached(root) ((root)->leftmost)
+
+#endif
@@ -18,6 +18,7 @@ typedef struct {
 void spin_init(spinlock_t *lock,const char *);
 void spin_lock(spinlock_t *lock);
 void spin_unlock(spinlock_t *lock);
+int spin_trylock(spinlock_t *lock);
 void pop_off();
 void push_off();
 int holding(spinlock_t *lock);
@@ -2,8 +2,16 @@
 #define __STRING_H__
 #include "std/stddef.h"
 
+// 不小于这个长度的 memcpy/memset 在有 V 扩展时用向量指令
+#define RVV_THRESHOLD 256
+
+extern int rvv_enabled;
+
 extern void *memset(void *dst, int c, uint64 n);
 extern void *memcpy(void *dst, const void *src, uint64 n);
+extern void *memmove(void *dst, const void *src, uint64 n);
+extern int memcmp(const void *v1, const void *v2, uint64 n);
+extern uint64 strlen(const char *str);
 
 extern int strdup(void *dst, const void *src);
 extern int strncpy(void *dst, const void *src,uint16 len);
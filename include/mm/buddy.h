@@ -7,6 +7,19 @@
 #define MAX_LEVEL_INDEX (MAX_LEVEL - 1)
 #define MAX_LEVEL_COUNT (1 << MAX_LEVEL_INDEX)
 
+// 页面块：按 2^PAGEBLOCK_ORDER 个页面为一组记录迁移类型，
+// 同类的分配尽量集中在同类的页面块中，长期占用的页面不会把大块内存打散
+#define PAGEBLOCK_ORDER 9
+#define PAGEBLOCK_NR (1 << PAGEBLOCK_ORDER)
+
+// 迁移类型
+#define MIGRATE_UNMOVABLE 0   // 页表、内核栈、一般的 slab
+#define MIGRATE_RECLAIMABLE 1 // 可以回收的 slab（缓存头、inode、dentry）
+#define MIGRATE_MOVABLE 2     // 可以搬迁的页面（块缓存）
+#define MIGRATE_PCPTYPES 3    // 每个 CPU 的缓存只缓存上面几种
+#define MIGRATE_ISOLATE 3     // 正在整理的页面块，其中的空闲页面不会被分配出去
+#define MIGRATE_TYPES 4
+
 
 
 #endif
\ No newline at end of file
@@ -3,7 +3,11 @@
 
 #include "mm/slab.h"
 
-
+#define KMALLOC_MIN_SIZE 16
+#define KMALLOC_SMALL_MAX 128 // 这以内按 KMALLOC_MIN_SIZE 递增
+#define KMALLOC_SMALL_CLASSES (KMALLOC_SMALL_MAX / KMALLOC_MIN_SIZE)
+#define KMALLOC_MAX_SIZE 8192 // 再大的直接从伙伴系统分配
+#define KMALLOC_NR_CLASSES (KMALLOC_SMALL_CLASSES + 6 * 8) // 128 到 8192 之间每翻一倍 8 级
 
 extern void kmalloc_init();
 extern void *kmalloc(int size, uint32 flags);
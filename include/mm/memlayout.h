@@ -21,6 +21,10 @@
 // end -- start of kernel page allocation area
 // PHYSTOP -- end RAM used by the kernel
 
+// core local interruptor (CLINT)，每个 hart 一个 msip 寄存器，写 1 触发机器模式软中断
+#define CLINT 0x2000000L
+#define CLINT_MSIP(hart) (CLINT + 4 * (hart))
+
 // qemu puts UART registers here in physical memory.
 #define UART0 0x10000000L
 #define UART0_IRQ 10
@@ -2,6 +2,12 @@
 #define __MM_H__
 #include "std/stddef.h"
 
+// 分配标志（gfp），决定页面的迁移类型
+#define GFP_KERNEL 0                 // 不可移动
+#define __GFP_RECLAIMABLE (1 << 0)   // 可回收
+#define __GFP_MOVABLE (1 << 1)       // 可搬迁，分配者需要用 page_set_movable 登记搬迁函数
+#define __GFP_ZERO (1 << 2)          // 页面需要清零，不带的话内容是任意的
+
 void mem_init();
 struct page * alloc_pages(uint32 flags, const int order);
 struct page * alloc_page(uint32 flags);
@@ -14,5 +20,12 @@ void * __alloc_page(uint32 flags);
 void __free_pages(void* addr, const int order);
 void __free_page(void* addr);
 
+void buddy_info();
+int compact_memory(int order);
+
+// 空闲的 CPU 在调度器中每次最多补充的清零页面数
+#define ZERO_POOL_BATCH 8
+int zero_pool_refill(int n);
+
 
 #endif
\ No newline at end of file
@@ -37,6 +37,8 @@
 #define PG_anon (1 << 2)     // 是否为匿名页面（非文件映射的页面），可用于堆栈、堆和内核
 #define PG_reserved (1 << 3) // 是否为保留页面，避免被操作系统的分配器使用
 #define PG_Slab (1 << 4) // 用于 Slab
+#define PG_buddy (1 << 5)    // 伙伴系统中空闲块的头页，order 有效
+#define PG_large (1 << 6)    // kmalloc 直接从伙伴系统分配的大块的头页，order 有效
 
 #define PG_FREE -1
 
@@ -45,8 +47,15 @@ struct page
 {
     uint32 flags;
     atomic_t count; // 引用计数 -1 没有引用；0 被分配但未被显式引用
+    int order;      // PG_buddy 时为所在空闲块的大小；PG_large 时为分配出去的块的大小
     struct list_head buddy;
-    struct slab * slab;
+    union
+    {
+        struct slab *slab;
+        void *private; // 可移动页面的所有者
+    };
+    // 可移动页面的搬迁函数：把 from 的内容复制到 to，并把所有者的引用改到 to，成功返回 0
+    int (*migrate)(struct page *from, struct page *to);
 };
 
 struct mem_map_struct{
@@ -73,7 +82,15 @@ int             page_count(struct page *pg);
 void            page_push(struct page *page);
 void            page_pop(struct page *page);
 
+// 登记可移动页面，内存整理时会调用 migrate 把它搬走
+static inline void page_set_movable(struct page *page, int (*migrate)(struct page *, struct page *), void *private)
+{
+    page->private = private;
+    page->migrate = migrate;
+}
+
+// 引用 -1，返回是否回到了没有引用（可以释放）
 #define page_pop_test(page) \
-    atomic_dec_and_test(&(page)->count)
+    (atomic_dec_return(&(page)->count) == PG_FREE)
 
 #endif
\ No newline at end of file
@@ -6,8 +6,10 @@
 #include "param.h"
 
 #define CACHE_MAX_NAME_LEN 24
-#define FREE_LIST_MAX_LEN (PGSIZE / 16)
 #define MIN_OBJ_COUNT_PER_PAGE 4
+#define SLAB_MAX_ALIGN 64 // 对象最多按 cache line 对齐
+#define SLAB_MAX_ORDER 4  // 为了排得更紧最多加大到的 order
+#define SLAB_FREE_HIGH 2  // 每个缓存最多留着的空闲 slab 数，多出来的直接还给伙伴系统
 
 struct slab;
 
@@ -18,17 +20,24 @@ struct kmem_cache
     spinlock_t lock;
 
     char name[CACHE_MAX_NAME_LEN];
-    uint32 flags;
+    uint32 flags; // 分配 slab 页面用的 gfp 标志
     uint16 size;
+    uint16 offset; // 空闲对象中 next 指针的偏移
     uint8 order;
     uint16 count_per_slab;
+    void (*ctor)(void *obj); // 对象的构造函数，新建 slab 时每个对象调用一次
 
     struct list_head part_slabs;
     struct list_head full_slabs;
+    struct list_head free_slabs; // 对象全部空闲的 slab，内存紧张时被回收
+    uint16 nr_free_slabs;
     struct list_head list;
 };
 
-// 占用一个页面
+// 放在 slab 页面的开头，对象紧跟在后面
+// 每个 CPU 有一个活动 slab（cache_cpu），被“冻结”在这个 CPU 上，只有它能不加锁地操作 free_list
+// 别的 CPU 释放活动 slab 上的对象时，无锁地压进 remote_free，由所属 CPU 在本地用完时取走
+// 不是活动 slab 时 remote_free 为 SLAB_UNFROZEN，挂在 part_slabs/full_slabs/free_slabs 上，由 kmem_cache 的锁保护
 struct slab
 {
     struct kmem_cache *kc;
@@ -36,9 +45,12 @@ struct slab
     uint16 inuse;
     struct list_head list;
 
-    void *free_list;
+    void *free_list;            // 空闲对象链表，next 指针存放在对象的 kc->offset 处
+    void *volatile remote_free; // 远程释放的对象链表，同上
 };
 
+#define SLAB_UNFROZEN ((void *)1)
+
 extern struct kmem_cache task_struct_kmem_cache;
 extern struct kmem_cache thread_info_kmem_cache;
 extern struct kmem_cache buf_kmem_cache;
@@ -53,9 +65,11 @@ extern struct kmem_cache vma_kmem_cache;
 // 初始化全局内核缓存
 void kmem_cache_init();
 
-void kmem_cache_create(struct kmem_cache *cache, const char *name, uint16 size, uint32 flags);
+void kmem_cache_create(struct kmem_cache *cache, const char *name, uint16 size, uint32 flags, void (*ctor)(void *));
 void kmem_cache_destory(struct kmem_cache *cache);
 void *kmem_cache_alloc(struct kmem_cache *cache);
 void kmem_cache_free(struct kmem_cache *cache, void *obj);
+int kmem_cache_shrink(struct kmem_cache *cache);
+int kmem_cache_shrink_all();
 
 #endif
\ No newline at end of file
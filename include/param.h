@@ -3,6 +3,7 @@
 
 // #define NPROC        64  // maximum number of processes
 #define NCPU          4  // maximum number of CPUs
+#define NPID       1024  // maximum number of live thread ids
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
@@ -21,6 +21,19 @@ r_mhartid()
 #define MSTATUS_MPP_U (0L << 11)
 
 #define MSTATUS_MIE (1L << 3) // 全局中断使能位
+#define MSTATUS_VS_MASK (3L << 9)    // 向量单元状态，0 为关闭
+#define MSTATUS_VS_INITIAL (1L << 9)
+
+// misa 中各扩展对应的位，第 i 位为字母 'A' + i
+#define MISA_V (1L << ('V' - 'A'))
+
+static inline uint64
+r_misa()
+{
+  uint64 x;
+  asm volatile("csrr %0, misa" : "=r"(x));
+  return x;
+}
 
 static inline uint64
 r_mstatus()
@@ -48,6 +61,8 @@ w_mepc(uint64 x)
 // Supervisor Status Register, sstatus
 
 #define SSTATUS_SUM (1L << 18) // 允许 Supervisor 访问 user 页表
+#define SSTATUS_VS_MASK (3L << 9)    // 向量单元状态，0 为关闭
+#define SSTATUS_VS_INITIAL (1L << 9)
 #define SSTATUS_SPP (1L << 8)  // Previous mode, 1=Supervisor, 0=User
 #define SSTATUS_SPIE (1L << 5) // Supervisor Previous Interrupt Enable
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
@@ -83,6 +98,8 @@ w_sscratch(uint64 x)
 }
 
 // Supervisor Interrupt Pending
+#define SIP_SSIP (1L << 1) // software
+
 static inline uint64
 r_sip()
 {
@@ -117,6 +134,7 @@ w_sie(uint64 x)
 }
 
 // Machine-mode Interrupt Enable
+#define MIE_MSIE (1L << 3) // machine software（CLINT msip，用于核间中断）
 #define MIE_STIE (1L << 5) // supervisor timer
 #define MIE_MEIE (1 << 11) // 外部中断使能位
 static inline uint64
@@ -180,6 +198,19 @@ w_mideleg(uint64 x)
   asm volatile("csrw mideleg, %0" : : "r"(x));
 }
 
+// Machine-mode interrupt vector
+static inline void
+w_mtvec(uint64 x)
+{
+  asm volatile("csrw mtvec, %0" : : "r"(x));
+}
+
+static inline void
+w_mscratch(uint64 x)
+{
+  asm volatile("csrw mscratch, %0" : : "r"(x));
+}
+
 // Supervisor Trap-Vector Base Address
 // low two bits are mode.
 static inline void
@@ -248,6 +279,11 @@ w_pmpaddr0(uint64 x)
 
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
 
+// satp 中的 ASID 字段（44..59），实际支持的位数要写全 1 再读回来才知道
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK 0xFFFFL
+#define MAKE_SATP_ASID(pagetable, asid) (MAKE_SATP(pagetable) | ((uint64)(asid) << SATP_ASID_SHIFT))
+
 // supervisor address translation and protection;
 // holds the address of the page table.
 static inline void
@@ -368,6 +404,20 @@ sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// 只刷新 asid 的非全局表项
+static inline void
+sfence_vma_asid(uint64 asid)
+{
+  asm volatile("sfence.vma zero, %0" : : "r"(asid) : "memory");
+}
+
+// 只刷新 asid 中 va 所在页面的表项
+static inline void
+sfence_vma_page(uint64 va, uint64 asid)
+{
+  asm volatile("sfence.vma %0, %1" : : "r"(va), "r"(asid) : "memory");
+}
+
 typedef uint64 pte_t;
 typedef uint64 *pagetable_t; // 512 PTEs
 
@@ -386,6 +436,7 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // user can access
+#define PTE_G (1L << 5) // global，所有地址空间都一样的映射，按 ASID 刷新 TLB 时不会被刷掉
 #define PTE_COW (1 << 8)
 
 // shift a physical address to the right place for a PTE.
@@ -395,11 +446,16 @@ typedef uint64 *pagetable_t; // 512 PTEs
 
 #define PTE_FLAGS(pte) ((pte) & 0x3FF)
 
+// R/W/X 有一个不为 0 就是叶子页表项，在 1、2 级就是 2M、1G 的大页
+#define PTE_LEAF(pte) ((pte) & (PTE_R | PTE_W | PTE_X))
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PXMASK 0x1FF // 9 bits
 #define PXSHIFT(level) (PGSHIFT + (9 * (level)))
 // 在 va 中提取第 leval 级别的 9 位。分别取 30..38 21..29 12..20
 #define PX(level, va) ((((uint64)(va)) >> PXSHIFT(level)) & PXMASK)
+// 第 level 级的一个叶子页表项映射的大小：4K、2M、1G
+#define PXSIZE(level) (1L << PXSHIFT(level))
 
 // one beyond the highest possible virtual address.
 // MAXVA is actually one bit less than the max allowed by
@@ -7,6 +7,8 @@
 #include "dev/blk/gendisk.h"
 #include "core/timer.h"
 #include "mm/mm.h"
+#include "mm/page.h"
+#include "lib/string.h"
 
 inline void buf_pin(struct buf_head *b)
 {
@@ -114,6 +116,40 @@ static struct buf_head *bhash_find(struct bhash_struct *bhash, uint _blockno)
     return b;
 }
 
+// 内存整理时把缓存搬到新页面
+// 只搬没有人引用（refcnt 为 0，也就没有 IO）、不脏（回写线程不会去碰）、没有被锁住的缓存
+// 整理可能发生在持有 bhash 锁的分配路径里，这里只尝试加锁
+static int buf_migrate_page(struct page *from, struct page *to)
+{
+    struct buf_head *b = (struct buf_head *)from->private;
+    struct bhash_struct *bhash = &b->gd->bhash;
+    int ret = -1;
+
+    if (!spin_trylock(&bhash->lock))
+        return -1;
+    if (b->page == (void *)get_page_addr(from) && atomic_read(&b->refcnt) == 0 &&
+        !TEST_FLAG(&b->flags, BH_Dirty) && !b->lock.locked)
+    {
+        memcpy((void *)get_page_addr(to), b->page, PGSIZE);
+        b->page = (void *)get_page_addr(to);
+        page_set_movable(to, buf_migrate_page, b);
+        ret = 0;
+    }
+    spin_unlock(&bhash->lock);
+    return ret;
+}
+
+// buf_kmem_cache 的构造函数，锁和链表只在新建 slab 时初始化一次
+void buf_ctor(void *obj)
+{
+    struct buf_head *b = (struct buf_head *)obj;
+
+    sleep_init(&b->lock, "buf_head");
+    INIT_HASH_NODE(&b->bh_node);
+    INIT_LIST_HEAD(&b->lru);
+    INIT_LIST_HEAD(&b->dirty);
+}
+
 // 尤其注意，获取前需要调用 bhash_find 查找
 // 这个是专门用于申请新 buf_head 的
 // 内存中绝不允许存在两个一样块号的缓存
@@ -126,17 +162,15 @@ static struct buf_head *buf_alloc(struct gendisk *gd, uint blockno)
 
     b->gd = gd;
     b->blockno = blockno;
-    sleep_init(&b->lock, "buf_head");
     atomic_set(&b->refcnt, 0);
-    INIT_HASH_NODE(&b->bh_node);
-    INIT_LIST_HEAD(&b->lru);
-    INIT_LIST_HEAD(&b->dirty);
+    b->flags = 0;
 
     SET_FLAG(&b->flags, BH_New);
 
-    b->page = __alloc_page(0);
+    b->page = __alloc_page(__GFP_MOVABLE);
     if (!b->page)
         panic("buf_alloc");
+    page_set_movable(get_page_struct((uint64)b->page), buf_migrate_page, b);
 
     return b;
 }
@@ -157,6 +191,8 @@ struct buf_head *buf_get(struct gendisk *gd, uint blockno)
 
         // creating = 1;
     }
+    // 在锁内增加引用，内存整理据此判断缓存是否正在使用
+    atomic_inc(&buf->refcnt);
     spin_unlock(&gd->bhash.lock);
     // if (!TEST_FLAG(&buf->flags, BH_Valid))
     // {
@@ -168,7 +204,6 @@ struct buf_head *buf_get(struct gendisk *gd, uint blockno)
     //     SET_FLAG(&buf->flags, BH_Valid);
     //     wake_up(&buf->lock);
     // }
-    atomic_inc(&buf->refcnt);
     return buf;
 }
 
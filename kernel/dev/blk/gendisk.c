@@ -48,9 +48,9 @@ void gendisk_init(struct block_device *bd, const struct gendisk_operations *ops)
     gd_ops->write = (ops->write) ? (ops->write) : gen_write;
 
     bhash_init(&gd->bhash, gd);
-    kthread_create(kthread_gen_start_io, gd, "gen_start_io", NO_CPU_AFF);
+    kthread_create_rt(kthread_gen_start_io, gd, "gen_start_io", NO_CPU_AFF, SCHED_FIFO, KTHREAD_PRIO_IO);
 
-    kthread_create(flush_bhash, &gd->bhash, "gen_flush_bhash", NO_CPU_AFF);
+    kthread_create_rt(flush_bhash, &gd->bhash, "gen_flush_bhash", NO_CPU_AFF, SCHED_RR, KTHREAD_PRIO_FLUSH);
 }
 
 // 这个重要
@@ -2,6 +2,14 @@
 #include "../fs/easyfs/easyfs.h"
 #include "mm/slab.h"
 
+// file_kmem_cache 的构造函数，互斥量只在新建 slab 时初始化一次
+// 关闭文件时互斥量一定是放开的，释放回缓存仍然是构造好的状态
+void file_ctor(void *obj)
+{
+    struct file *f = (struct file *)obj;
+    mutex_init(&f->f_mutex, "file f_mutex");
+}
+
 static struct file *file_alloc()
 {
     struct file *f = kmem_cache_alloc(&file_kmem_cache);
@@ -9,7 +17,6 @@ static struct file *file_alloc()
     f->f_ip = NULL;
     f->f_off = 0;
     atomic_set(&f->f_ref, 0);
-    mutex_init(&f->f_mutex, "file f_mutex");
     return f;
 }
 
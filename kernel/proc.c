@@ -6,6 +6,7 @@
 
 #include "lib/list.h"
 #include "lib/string.h"
+#include "lib/bitmap.h"
 
 #include "core/vm.h"
 #include "core/proc.h"
@@ -14,9 +15,10 @@
 
 static struct
 {
-  // 用于分配 pid 由于我们使用了slab回收的可以直接利用
-  int pids;
-  // 保护pids的递增
+  // 用于分配 pid，线程回收时归还，下次分配优先复用最小的空闲号
+  struct bitmap pids;
+  uint64 map[NPID / 64];
+  // 保护 pids
   spinlock_t lock;
 } pid_pool;
 
@@ -43,9 +45,7 @@ static void thread_exit()
 {
   struct thread_info *thread = myproc();
 
-  // 由父进程来回收的
-  // kmem_cache_free(&task_struct_kmem_cache, current_->task);
-  // kmem_cache_free(&thread_info_kmem_cache, current_);
+  // 自己还在这个栈上，不能释放自己，切换走之后由 reap_zombies 回收
   printk("thread: %s exit!\n", thread->name);
 
   // 需要在关中断的情况下切换进入调度器上下文
@@ -57,8 +57,9 @@ static void thread_exit()
 static void thread_entry()
 {
   struct thread_info *thread = myproc();
-  // 第一次需要释放锁
+  // 第一次需要释放锁：自己的锁，以及直接切换过来时上一个线程的锁
   // printk("Thread %s release lock on cpu %d in thread_entry  --only once\n", thread->name, cpuid());
+  finish_task_switch();
   spin_unlock(&thread->lock);
   intr_on(); // 需要开中断。由时钟中断->调度器切换->是关了中断的，要重新打开
   thread->func(thread->args);
@@ -112,7 +113,18 @@ static inline void thread_info_init(struct thread_info *thread)
   // thread->pid = -1;
 
   thread->tf = NULL;
-  thread->ticks = 10;
+  thread->policy = SCHED_NORMAL;
+  thread->prio = DEFAULT_PRIO;
+  thread->nice = 0;
+  thread->weight = NICE_0_WEIGHT;
+  thread->vruntime = 0;
+  thread->exec_start = 0;
+  thread->slice_start = 0;
+  thread->sum_exec_runtime = 0;
+  thread->last_cpu = -1;
+  thread->last_ran = 0;
+  thread->enqueue_time = 0;
+  RB_CLEAR_NODE(&thread->run_node);
   thread->args = NULL;
   thread->func = NULL;
   thread->cpu_affinity = NO_CPU_AFF;
@@ -123,10 +135,11 @@ static inline void thread_info_init(struct thread_info *thread)
   thread->context.sp = Kernel_stack_top(thread);
 }
 
-// 这里应该是从 scheduler 的 swtch 进入
-// 在 scheduler 中获取了锁，这里需要释放
+// 这里从 scheduler 或者另一个线程的 sched 中的 swtch 进入
+// 切换前获取了锁，这里需要释放
 static void forkret()
 {
+  finish_task_switch();
   spin_unlock(&myproc()->lock);
   usertrapret();
 }
@@ -148,12 +161,53 @@ static struct thread_info *alloc_thread()
   thread->task = task;
 
   spin_lock(&pid_pool.lock);
-  thread->pid = thread->pid == 0 ? pid_pool.pids++ : thread->pid;
+  thread->pid = bitmap_alloc(&pid_pool.pids);
   spin_unlock(&pid_pool.lock);
+  if (thread->pid < 0)
+  {
+    printk("alloc_thread: out of pid\n");
+    kmem_cache_free(&thread_info_kmem_cache, thread);
+    kmem_cache_free(&task_struct_kmem_cache, task);
+    return NULL;
+  }
 
   return thread;
 }
 
+// 释放 alloc_thread 申请的 PCB 以及 trapframe，归还 pid
+// 用户线程还要释放地址空间：页表以及对映射的页面的引用（共享的页面最后一个引用放掉时才真正释放）
+void free_thread(struct thread_info *thread)
+{
+  if (thread->tf)
+  {
+    uvm_free(&thread->task->mm);
+    kmem_cache_free(&tf_kmem_cache, thread->tf);
+  }
+  kmem_cache_free(&task_struct_kmem_cache, thread->task);
+
+  spin_lock(&pid_pool.lock);
+  bitmap_free(&pid_pool.pids, thread->pid);
+  spin_unlock(&pid_pool.lock);
+
+  kmem_cache_free(&thread_info_kmem_cache, thread);
+}
+
+// 回收本 CPU 上已经退出的线程
+// 线程在 quit 中关着中断挂到本 CPU 的 out 链表上，然后切换走；
+// 在 finish_task_switch 释放了它的锁之后，它的栈已经不再使用，可以安全释放
+void reap_zombies(struct cpu *cpu)
+{
+  struct thread_info *thread;
+
+  while (!list_empty(&cpu->sched_list.out))
+  {
+    thread = list_entry(list_first(&cpu->sched_list.out), struct thread_info, sched);
+    list_del(&thread->sched);
+    assert(thread->state == ZOMBIE, "reap_zombies: '%s' state: %d", thread->name, thread->state);
+    free_thread(thread);
+  }
+}
+
 struct thread_info *alloc_kthread()
 {
   struct thread_info *t = alloc_thread();
@@ -211,7 +265,7 @@ struct thread_info *myproc()
 void proc_init()
 {
   spin_init(&pid_pool.lock, "pid_pool");
-  pid_pool.pids = 0;
+  bitmap_init(&pid_pool.pids, pid_pool.map, NPID);
 }
 
 //  TODO 检查地址合法性
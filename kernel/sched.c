@@ -6,77 +6,582 @@
 #include "lib/atomic.h"
 #include "lib/string.h"
 #include "core/vm.h"
+#include "lib/math.h"
+#include "lib/rbtree.h"
+#include "dev/clint.h"
+#include "core/timer.h"
+#include "mm/mm.h"
 
 // 0号进程也就是第一个内核线程，负责初始化部分内容后作为调度器而存在
 
 // 为每一个cpu分配一个调度队列
-// 在顶层以后可以加一个负载均衡的分配器
-// 负责分发不同的任务，现在为了简单就直接轮转加入
-
-// 负载均衡器，这里暂时轮转分配(有点性能问题)
-spinlock_t load_lock;
-int load_cpu_id = -1;
+// 唤醒时根据各个 CPU 的负载选择一个最空闲的加入，不再使用全局锁轮转
+// 空闲的 CPU 会从最忙的 CPU 上窃取可运行的线程
+// 普通线程按 vruntime 公平调度（类似 CFS），固定优先级的线程排在它们前面
 
 struct thread_info *init_thread;
 // switch.S
 extern void swtch(struct context *, struct context *);
 
-// 从调度队列中选择下一个要执行的线程
-// 如果有其他进程，则选择其他的
-static struct thread_info *pick_next_task(struct list_head *run_list)
+// nice 值 -20..19 对应的权重，nice 每差 1 大约差 10% 的 CPU 时间（与 Linux 相同）
+static const uint32 nice_to_weight[40] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */ 9548, 7620, 6100, 4904, 3906,
+    /*  -5 */ 3121, 2501, 1991, 1586, 1277,
+    /*   0 */ 1024, 820, 655, 526, 423,
+    /*   5 */ 335, 272, 215, 172, 137,
+    /*  10 */ 110, 87, 70, 56, 45,
+    /*  15 */ 36, 29, 23, 18, 15,
+};
+
+// vruntime 可能回绕，比较时看差值的符号
+#define vruntime_before(a, b) ((long)((a) - (b)) < 0)
+
+static inline int is_fair_task(struct thread_info *thread)
+{
+    return thread->policy == SCHED_NORMAL;
+}
+
+// CPU 的负载：就绪队列长度 + 当前是否有线程在运行
+// 这里不加锁读取，只是一个估计值，偏差一点没关系
+static inline int cpu_load(int cpu)
+{
+    return cpus[cpu].sched_list.nr_running + (cpus[cpu].thread != NULL);
+}
+
+// 负载最小的 CPU，负载相同时优先当前 CPU
+// * 必须在关中断环境下（cpuid）
+static int find_idlest_cpu()
+{
+    int i, cpu, min_load, load;
+
+    cpu = cpuid();
+    min_load = cpu_load(cpu);
+    for (i = 0; i < NCPU && min_load > 0; i++)
+    {
+        load = cpu_load(i);
+        if (load < min_load)
+        {
+            min_load = load;
+            cpu = i;
+        }
+    }
+    return cpu;
+}
+
+// 为线程选择要入队的 CPU
+// 尽量放回上次运行的 CPU，缓存还是热的；被唤醒时，如果唤醒者所在的 CPU 除了唤醒者没有别的活，
+// 就放到唤醒者身边（生产者/消费者共享数据）；只有这两个 CPU 都明显比最闲的 CPU 忙时才分散出去
+// * 必须在关中断环境下（cpuid）
+static int select_task_cpu(struct thread_info *thread, int wakeup)
+{
+    int prev = thread->last_cpu, self = cpuid(), idlest;
+
+    if (thread->cpu_affinity != NO_CPU_AFF)
+        return thread->cpu_affinity;
+    // 还没运行过，没有缓存可言
+    if (prev < 0)
+        return find_idlest_cpu();
+
+    if (cpu_load(prev) == 0)
+        return prev;
+    if (wakeup && self != prev && cpus[self].sched_list.nr_running == 0)
+        return self;
+
+    idlest = find_idlest_cpu();
+    if (cpu_load(prev) <= cpu_load(idlest) + 1)
+        return prev;
+    return idlest;
+}
+
+static void prio_array_init(struct prio_array *array)
+{
+    array->bitmap = 0;
+    for (int i = 0; i < MAX_PRIO; i++)
+        INIT_LIST_HEAD(&array->queue[i]);
+}
+
+// min_vruntime 只增不减：取当前线程与树中最左线程 vruntime 的较小者
+// 需要持有 sched_list 锁
+static void update_min_vruntime(struct sched_struct *sl, struct thread_info *curr)
+{
+    uint64 vruntime = sl->min_vruntime;
+    struct rb_node *leftmost = rb_first_cached(&sl->fair);
+
+    if (curr && is_fair_task(curr))
+        vruntime = curr->vruntime;
+    if (leftmost)
+    {
+        struct thread_info *t = rb_entry(leftmost, struct thread_info, run_node);
+        if (!curr || !is_fair_task(curr) || vruntime_before(t->vruntime, vruntime))
+            vruntime = t->vruntime;
+    }
+    if (vruntime_before(sl->min_vruntime, vruntime))
+        sl->min_vruntime = vruntime;
+}
+
+// 实时限流的周期到了就重新开始计数，并解除限流
+// rt_* 只由本 CPU 在关中断时修改
+static void rt_period_update(struct sched_struct *sl, uint64 now)
+{
+    if (now - sl->rt_period_start < SCHED_RT_PERIOD)
+        return;
+    sl->rt_period_start = now;
+    sl->rt_time = 0;
+    sl->rt_throttled = 0;
+}
+
+// 实时线程是否被限流：用完了配额，而且确实有公平调度的线程在等
+// 只有实时线程的时候限流没有意义，照常运行
+static inline int rt_throttled(struct sched_struct *sl)
+{
+    return sl->rt_throttled && rb_first_cached(&sl->fair);
+}
+
+// 把当前线程自上次记账以来运行的时间计入 vruntime，权重越大涨得越慢
+// 实时线程的运行时间计入本 CPU 的限流配额
+static void update_curr(struct thread_info *curr)
+{
+    struct sched_struct *sl = &mycpu()->sched_list;
+    uint64 now = r_time();
+    uint64 delta = now - curr->exec_start;
+
+    curr->exec_start = now;
+    curr->sum_exec_runtime += delta;
+    if (is_fair_task(curr))
+        curr->vruntime += delta * NICE_0_WEIGHT / curr->weight;
+    else
+    {
+        rt_period_update(sl, now);
+        sl->rt_time += delta;
+        if (sl->rt_time > SCHED_RT_RUNTIME)
+            sl->rt_throttled = 1;
+    }
+}
+
+// 入队，需要持有 sched_list 锁
+// 公平调度的线程插入红黑树（按 vruntime 排序），实时线程进入优先级数组的队尾，head 为 1 时放到队首
+static void enqueue_task(struct sched_struct *sl, struct thread_info *thread, int head)
+{
+    if (is_fair_task(thread))
+    {
+        struct rb_node **link = &sl->fair.root.node, *parent = NULL;
+        int leftmost = 1;
+        while (*link)
+        {
+            parent = *link;
+            if (vruntime_before(thread->vruntime, rb_entry(parent, struct thread_info, run_node)->vruntime))
+                link = &parent->left;
+            else
+            {
+                link = &parent->right;
+                leftmost = 0;
+            }
+        }
+        rb_link_node(&thread->run_node, parent, link);
+        rb_insert_color_cached(&thread->run_node, &sl->fair, leftmost);
+        sl->load += thread->weight;
+    }
+    else
+    {
+        if (head)
+            list_add_head(&thread->sched, &sl->run.queue[thread->prio]);
+        else
+            list_add_tail(&thread->sched, &sl->run.queue[thread->prio]);
+        sl->run.bitmap |= (1U << thread->prio);
+    }
+    sl->nr_running++;
+    thread->enqueue_time = r_time();
+}
+
+// 把一次就绪队列等待时间计入直方图
+static void account_wait(struct sched_stats *st, uint64 wait)
+{
+    uint64 bound = 100; // 10us
+    int i;
+
+    for (i = 0; i < SCHED_WAIT_BUCKETS - 1 && wait >= bound; i++)
+        bound *= 10;
+    st->wait_hist[i]++;
+    if (wait > st->wait_max)
+        st->wait_max = wait;
+}
+
+// 从就绪队列摘下，需要持有 sched_list 锁
+static void dequeue_task(struct sched_struct *sl, struct thread_info *thread)
+{
+    if (is_fair_task(thread))
+    {
+        rb_erase_cached(&thread->run_node, &sl->fair);
+        sl->load -= thread->weight;
+    }
+    else
+    {
+        list_del(&thread->sched);
+        if (list_empty(&sl->run.queue[thread->prio]))
+            sl->run.bitmap &= ~(1U << thread->prio);
+    }
+    sl->nr_running--;
+    // 摘下的线程马上要在本 CPU 上运行（本地选取或者窃取），统计记在本 CPU 上
+    account_wait(&mycpu()->sched_list.stats, r_time() - thread->enqueue_time);
+}
+
+// 从调度队列中选择下一个要执行的线程，O(1)：
+// 先看实时线程（优先级最高的非空队列的队首），再看公平调度树中 vruntime 最小的
+// 实时线程被限流时先让公平调度的线程运行
+// 需要持有 sched_list 锁。返回时已经持有线程锁并从就绪队列摘下
+// prev 是正在让出 CPU 的线程（锁已经在手上），选中它自己时不再加锁
+static struct thread_info *pick_next_task(struct sched_struct *sl, struct thread_info *prev)
 {
     struct thread_info *thread;
-    if (list_empty(run_list))
+
+    rt_period_update(sl, r_time());
+    if (sl->run.bitmap && !rt_throttled(sl))
+        thread = list_entry(list_first(&sl->run.queue[first_set_bit(sl->run.bitmap)]), struct thread_info, sched);
+    else if (rb_first_cached(&sl->fair))
+        thread = rb_entry(rb_first_cached(&sl->fair), struct thread_info, run_node);
+    else
         return NULL;
-    // printk("cpu%d: sched len:%d\n", cpuid(), list_len(run_list));
-    list_for_each_entry_reverse(thread, run_list, sched)
+
+    // 原则上每个CPU有自己的调度队列，不会出现多个CPU同时调度一个线程的情况
+    // 但是我们走 sleep 时候要主动让出CPU，在信号量中有对进程加锁，因此这里交换回来要解锁
+    // 同理,我们在交换出去的时候加锁
+    if (thread != prev)
+        spin_lock(&thread->lock);
+    dequeue_task(sl, thread);
+    update_min_vruntime(sl, thread);
+    return thread;
+}
+
+// 找到就绪队列最长的 CPU
+static int find_busiest_cpu(int self)
+{
+    int i, busiest = -1, max = 0;
+    for (i = 0; i < NCPU; i++)
+    {
+        if (i == self)
+            continue;
+        if (cpus[i].sched_list.nr_running > max)
+        {
+            max = cpus[i].sched_list.nr_running;
+            busiest = i;
+        }
+    }
+    return busiest;
+}
+
+// 线程的缓存是否还热：刚下处理机不久
+static inline int task_hot(struct thread_info *thread, uint64 now)
+{
+    return now - thread->last_ran < SCHED_MIGRATION_COST;
+}
+
+// 在 victim 队列中找一个可以迁移的线程：没有绑定 CPU 的
+// 固定优先级的从最低优先级的队尾找，公平调度的从 vruntime 最大的找（最后才会被运行的）
+// allow_hot 为 0 时跳过缓存还热的线程，迁移它们的代价比在原 CPU 上多等一会更大
+// 找到时已经持有线程锁。这里拿着对方的队列锁，只能 trylock：
+// 对方 sched() 中让出的线程已经入队，但它的锁要切换完成后才放开，而对方此时正等着这把队列锁
+static struct thread_info *find_stealable(struct sched_struct *sl, int allow_hot)
+{
+    uint64 now = r_time();
+    struct thread_info *thread;
+    struct rb_node *node;
+    int prio;
+
+    for (prio = MAX_PRIO - 1; prio >= 0; prio--)
+    {
+        if (!(sl->run.bitmap & (1U << prio)))
+            continue;
+        list_for_each_entry_reverse(thread, &sl->run.queue[prio], sched)
+        {
+            if (thread->cpu_affinity == NO_CPU_AFF && (allow_hot || !task_hot(thread, now)) &&
+                spin_trylock(&thread->lock))
+                return thread;
+        }
+    }
+    for (node = rb_last(&sl->fair.root); node; node = rb_prev(node))
     {
-        // 找到一个可以运行的线程
-        if (thread->state == RUNNABLE)
+        thread = rb_entry(node, struct thread_info, run_node);
+        if (thread->cpu_affinity == NO_CPU_AFF && (allow_hot || !task_hot(thread, now)) &&
+            spin_trylock(&thread->lock))
             return thread;
     }
     return NULL;
 }
 
-static void add_runnable_task(struct thread_info *thread)
+// 从最忙的 CPU 上窃取一个可运行的线程
+// 返回时与 pick_next_task 一样，已经持有线程锁并从就绪队列摘下
+static struct thread_info *steal_task(int self)
 {
-    int cpuid;
-    int cpu_affinity = thread->cpu_affinity;
+    struct thread_info *thread;
+    struct sched_struct *sl;
+    int victim = find_busiest_cpu(self);
+    if (victim < 0)
+        return NULL;
 
-    spin_lock(&load_lock);
-    if (cpu_affinity == NO_CPU_AFF)
-        cpuid = load_cpu_id = (load_cpu_id + 1) % NCPU;
-    else
-        cpuid = cpu_affinity;
+    sl = &cpus[victim].sched_list;
+    spin_lock(&sl->lock);
+    // 对方积压得很多时，即使缓存还热也值得搬过来
+    thread = find_stealable(sl, sl->nr_running > 2);
+    if (!thread)
+    {
+        spin_unlock(&sl->lock);
+        return NULL;
+    }
+    dequeue_task(sl, thread);
+    // vruntime 是相对于原 CPU 的，换算到本 CPU
+    thread->vruntime = thread->vruntime - sl->min_vruntime + cpus[self].sched_list.min_vruntime;
+    spin_unlock(&sl->lock);
 #ifdef DEBUG_TASK_ADD_CPU
-    printk("add thread %s to cpu %d\n", thread->name, cpuid);
+    printk("cpu %d steal thread %s from cpu %d\n", self, thread->name, victim);
 #endif
-    spin_unlock(&load_lock);
+    return thread;
+}
 
-    spin_lock(&cpus[cpuid].sched_list.lock);
-    list_add_head(&thread->sched, &(cpus[cpuid].sched_list.run));
-    spin_unlock(&cpus[cpuid].sched_list.lock);
+// 需要持有线程锁
+// 不在 CPU 上的线程 vruntime 保存的是相对于 min_vruntime 的偏移（见 put_prev_task），入队时换算回来
+// wakeup 表示是睡眠后被唤醒：偏移是睡下时记的，睡眠期间 min_vruntime 还在前进（大约随时间），
+// 按睡眠的时长扣掉作为补偿，但最多领先 min_vruntime 半个调度周期，
+// 这样交互/IO 线程醒来后能很快被调度，又不会长期霸占 CPU
+static void __add_runnable_task(struct thread_info *thread, int cpu, int wakeup)
+{
+    struct sched_struct *sl = &cpus[cpu].sched_list;
+#ifdef DEBUG_TASK_ADD_CPU
+    printk("add thread %s to cpu %d\n", thread->name, cpu);
+#endif
+
+    spin_lock(&sl->lock);
+    if (is_fair_task(thread))
+    {
+        // exec_start 是上次下处理机的时间；刚创建的线程没有运行过，没有睡眠可言，不给补偿
+        if (wakeup && thread->exec_start)
+        {
+            long lag = (long)thread->vruntime - (long)(r_time() - thread->exec_start);
+            if (lag < -(long)(SCHED_LATENCY / 2))
+                lag = -(long)(SCHED_LATENCY / 2);
+            thread->vruntime = lag;
+        }
+        thread->vruntime += sl->min_vruntime;
+    }
+    // 被抢占的 SCHED_FIFO 线程还没有运行完，放回队首
+    enqueue_task(sl, thread, !wakeup && thread->policy == SCHED_FIFO);
+    spin_unlock(&sl->lock);
+
+    // 唤醒抢占：实时线程的优先级比目标 CPU 上正在运行的线程高，要求它尽快让出
+    // 本地的在中断返回前处理，远程的用核间中断通知
+    if (!is_fair_task(thread) && thread->prio < cpus[cpu].sched_list.curr_prio)
+    {
+        cpus[cpu].need_resched = 1;
+        if (cpu != cpuid())
+        {
+            clint_send_ipi(cpu);
+            return;
+        }
+    }
+
+    // 目标 CPU 正在 wfi 中空等，踢它一下，不然要等到它下一次时钟中断才能发现
+    // 目标 CPU 停了周期时钟（NO_HZ），也要让它重新打开，否则新线程可能很久得不到运行
+    // 与 scheduler/tick_nohz_stop 中先置标志再检查 nr_running 配对（spin_unlock 中有内存屏障）
+    if (cpu != cpuid())
+    {
+        if (cpus[cpu].is_idle || cpus[cpu].tick_stopped)
+            clint_send_ipi(cpu);
+    }
+    else
+        tick_restart();
+}
+
+// 入队到 select_task_cpu 选出的 CPU
+static inline void add_runnable_task(struct thread_info *thread, int wakeup)
+{
+    __add_runnable_task(thread, select_task_cpu(thread, wakeup), wakeup);
+}
+
+// 线程上处理机前的记账
+static inline void set_next_task(struct thread_info *next)
+{
+    mycpu()->sched_list.curr_prio = is_fair_task(next) ? MAX_PRIO : next->prio;
+    next->exec_start = next->slice_start = r_time();
+    if (next->last_cpu >= 0 && next->last_cpu != cpuid())
+        mycpu()->sched_list.stats.nr_migrations++;
+    next->last_cpu = cpuid();
 }
 
+// 线程下处理机时的记账：更新 vruntime，并转成相对于本 CPU min_vruntime 的偏移，
+// 这样它下次无论被放到哪个 CPU 上都能公平地排队
+// 需要持有线程锁
+static void put_prev_task(struct thread_info *prev)
+{
+    struct sched_struct *sl = &mycpu()->sched_list;
+
+    update_curr(prev);
+    prev->last_ran = prev->exec_start;
+    if (!is_fair_task(prev))
+        return;
+    spin_lock(&sl->lock);
+    update_min_vruntime(sl, prev);
+    prev->vruntime -= sl->min_vruntime;
+    spin_unlock(&sl->lock);
+}
+
+// 时钟中断中调用，判断当前线程是否应该让出 CPU
+// 公平调度的线程能连续运行的时间按权重分配一个调度周期，
+// 用完了，或者已经比树中最左的线程多跑了这么多，就让出
+// 实时线程只在有更高优先级的线程、SCHED_RR 时间片用完且有同优先级的线程、或者被限流时让出
+int sched_tick(struct thread_info *curr)
+{
+    struct sched_struct *sl = &mycpu()->sched_list;
+    struct rb_node *leftmost;
+    uint64 ideal, ran;
+    int resched = 0;
+
+    update_curr(curr);
+
+    spin_lock(&sl->lock);
+    ran = r_time() - curr->slice_start;
+    if (!is_fair_task(curr))
+    {
+        if (sl->run.bitmap && first_set_bit(sl->run.bitmap) < curr->prio)
+            resched = 1;
+        else if (curr->policy == SCHED_RR && ran > SCHED_RR_TIMESLICE && !list_empty(&sl->run.queue[curr->prio]))
+            resched = 1;
+        else if (rt_throttled(sl))
+            resched = 1;
+        spin_unlock(&sl->lock);
+        return resched;
+    }
+
+    update_min_vruntime(sl, curr);
+    // 有实时线程在等待（且没有被限流），直接让出
+    if (sl->run.bitmap && !rt_throttled(sl))
+        resched = 1;
+    else if ((leftmost = rb_first_cached(&sl->fair)) != NULL)
+    {
+        ideal = SCHED_LATENCY * curr->weight / (sl->load + curr->weight);
+        if (ideal < SCHED_MIN_GRANULARITY)
+            ideal = SCHED_MIN_GRANULARITY;
+        if (ran > ideal ||
+            (long)(curr->vruntime - rb_entry(leftmost, struct thread_info, run_node)->vruntime) > (long)ideal)
+            resched = 1;
+    }
+    spin_unlock(&sl->lock);
+    return resched;
+}
+
+// 设置公平调度线程的 nice 值，线程不能在就绪队列中（刚创建或正在运行）
+void sched_set_nice(struct thread_info *thread, int nice)
+{
+    if (nice < MIN_NICE)
+        nice = MIN_NICE;
+    if (nice > MAX_NICE)
+        nice = MAX_NICE;
+    spin_lock(&thread->lock);
+    thread->nice = nice;
+    thread->weight = nice_to_weight[nice - MIN_NICE];
+    spin_unlock(&thread->lock);
+}
+
+// 设置线程的调度策略，与 sched_set_nice 一样，线程不能在就绪队列中（刚创建或正在运行）
+// 成功返回 0，参数不合法返回 -1
+int sched_setscheduler(struct thread_info *thread, int policy, int prio)
+{
+    if (policy != SCHED_NORMAL && policy != SCHED_FIFO && policy != SCHED_RR)
+        return -1;
+    if (policy != SCHED_NORMAL && (prio < 0 || prio >= MAX_PRIO))
+        return -1;
+    spin_lock(&thread->lock);
+    thread->policy = policy;
+    if (policy != SCHED_NORMAL)
+        thread->prio = prio;
+    spin_unlock(&thread->lock);
+    return 0;
+}
+
+// 上下文切换完成后，在新的上下文中释放被切换出去的线程的锁
+// 切换前后两个线程的锁都由本 CPU 持有，只有切换完成、旧线程的栈不再使用后才能放开
+void finish_task_switch()
+{
+    struct cpu *cpu = mycpu();
+    struct thread_info *prev = cpu->prev;
+    int dead;
+
+    if (!prev)
+        return;
+    cpu->prev = NULL;
+    // 释放锁之前看状态：没退出的线程放锁后可能马上在别的 CPU 上运行
+    dead = prev->state == ZOMBIE;
+    spin_unlock(&prev->lock);
+    // 刚切走的如果是退出的线程，现在可以回收了
+    if (dead)
+        reap_zombies(cpu);
+}
+
+// 让出 CPU。本地队列中有可运行的线程时直接切换过去，不经过调度线程；
+// 只有本地没有可运行的线程时才切回调度线程，由它去偷任务或者进入空闲
 void sched(void)
 {
     int intena;
+    struct cpu *cpu = mycpu();
     struct thread_info *thread = myproc();
+    struct thread_info *next;
 
     assert(holding(&thread->lock) != 0, "sched: not held p->lock");                                     // 确保持有锁
     assert(thread->state != RUNNING, "sched: '%s' is running, state: %d", thread->name, thread->state); // 确保进程不在运行态
     assert(intr_get() == 0, "sched interruptible");                                                     // 确保关中断
 
-    intena = mycpu()->intena;
-    // printk("Thread %s switch to scheduler in sched\n", thread->name);
-    swtch(&thread->context, &mycpu()->context);
+    put_prev_task(thread);
+    // 如果是让出 CPU（而不是睡眠、退出），重新放回本 CPU 的就绪队列
+    // 不能放到别的 CPU 上：它的锁要到切换完成后才放开，两个 CPU 同时让出并且互相放到对方的队列上时，
+    // 各自拿着自己线程的锁去 pick_next_task 对方的线程，就死锁了（窃取只 trylock，见 find_stealable）
+    if (thread->state == RUNNABLE)
+        __add_runnable_task(thread, cpuid(), 0);
+
+    cpu->need_resched = 0;
+    spin_lock(&cpu->sched_list.lock);
+    next = pick_next_task(&cpu->sched_list, thread);
+    spin_unlock(&cpu->sched_list.lock);
+
+    // 选中的还是自己，不用切换
+    if (next == thread)
+    {
+        thread->state = RUNNING;
+        set_next_task(thread);
+        spin_unlock(&thread->lock);
+        return;
+    }
+
+    cpu->sched_list.stats.nr_switches++;
+    if (thread->state == RUNNABLE)
+        cpu->sched_list.stats.nr_involuntary++;
+    else
+        cpu->sched_list.stats.nr_voluntary++;
+
+    intena = cpu->intena;
+    cpu->prev = thread;
+    if (next)
+    {
+        next->state = RUNNING;
+        set_next_task(next);
+        cpu->thread = next;
+        tick_restart();
+#ifdef DEBUG_TASK_ON_CPU
+        printk("thread: %s in running on hart %d\n", next->name, cpuid());
+#endif
+        swtch(&thread->context, &next->context);
+    }
+    else
+        swtch(&thread->context, &cpu->context);
+
+    // 被重新调度回来，可能已经换了 CPU，不能再用上面的 cpu
+    finish_task_switch();
     spin_unlock(&thread->lock);
     // printk("Thread %s releasing lock on cpu %d ret sched\n", thread->name, cpuid());
 
     mycpu()->intena = intena;
 }
 
-// 从进程上下文切换到调度线程（主线程）, 进程交换上下文后中断返回
+// 让出 CPU：切换到下一个就绪线程，或者切回调度线程（主线程）, 交换上下文后中断返回
 void yield()
 {
     // printk("-----------timer interrupt yield!!!--------------\n");
@@ -84,10 +589,7 @@ void yield()
 
     // printk("Thread %s acquiring lock on cpu %d in yield\n", thread->name, cpuid());
     spin_lock(&thread->lock);
-    thread->ticks = 10;
     thread->state = RUNNABLE;
-    add_runnable_task(thread);
-    // list_add_tail(&thread->sched, &mycpu()->sched_list.run);
     sched();
 }
 
@@ -98,22 +600,28 @@ void scheduler()
     intr_on();
     while (1)
     {
+        cpu->need_resched = 0;
         spin_lock(&cpu->sched_list.lock);
-        struct thread_info *next = pick_next_task(&cpu->sched_list.run);
+        struct thread_info *next = pick_next_task(&cpu->sched_list, NULL);
+        spin_unlock(&cpu->sched_list.lock);
+
+        // 自己的队列空了，去别的 CPU 上偷一个
+        if (!next)
+            next = steal_task(cpuid());
+
         if (next)
         {
-            // 找到下一个线程，从就绪列表摘下
-            // 原则上每个CPU有自己的调度队列，不会出现多个CPU同时调度一个线程的情况
-            // 但是我们走 sleep 时候要主动让出CPU，在信号量中有对进程加锁，因此这里交换回来要解锁
-            // 同理,我们在交换出去的时候加锁
-            spin_lock(&next->lock);
+            // 找到下一个线程，已经从就绪列表摘下并持有线程锁
             // printk("Thread %s acquiring lock on cpu %d in scheduler\n", next->name, cpuid());
             // printk("pick thread name: %s\n", next->name);
-            list_del(&next->sched);
-            spin_unlock(&cpu->sched_list.lock);
-
             next->state = RUNNING;
+            set_next_task(next);
             cpu->thread = next;
+            // 从调度器切到线程（空闲后开始运行、偷来的线程）也是一次切换，
+            // 主动/被动只看让出的一方，已经在 sched() 中记过了
+            cpu->sched_list.stats.nr_switches++;
+            // 空闲时可能停了周期时钟，有线程要运行了，重新打开
+            tick_restart();
 #ifdef DEBUG_TASK_ON_CPU
             printk("thread: %s in running on hart %d\n", next->name, cpuid());
 #endif
@@ -124,29 +632,54 @@ void scheduler()
 
             // 线程已经在运行了
             // printk("thread: %s return..scheduler, intr: %d\n",next->name,intr_get());
-            // 下面是被调度返回了调度器线程
-            spin_unlock(&next->lock);
+            // 下面是被调度返回了调度器线程。线程之间会直接切换，
+            // 切回来的不一定是 next，释放的是最后切回调度器的那个线程的锁
+            finish_task_switch();
             // printk("Thread %s releasing lock on cpu %d in scheduler,intr: %d\n", next->name, cpuid(),intr_get());
             cpu->thread = NULL;
         }
         // 如果没有一个可以运行的进程，则运行idle
+        // 先声明自己空闲再检查一次队列：其他 CPU 入队后看到 is_idle 会发核间中断，
+        // 即使中断在 wfi 之前到达，挂起的中断也会让 wfi 立即返回，不会丢失唤醒
         else
         {
-            spin_unlock(&cpu->sched_list.lock);
-            intr_on();
-            asm volatile("wfi");
+            // 空闲时先补充清零页面池，补了的话回去重新看一下队列，没有可补的才 wfi
+            if (zero_pool_refill(ZERO_POOL_BATCH))
+                continue;
+            cpu->is_idle = 1;
+            __sync_synchronize();
+            if (cpu->sched_list.nr_running == 0)
+            {
+                uint64 start = r_time();
+                intr_on();
+                asm volatile("wfi");
+                cpu->sched_list.stats.idle_time += r_time() - start;
+            }
+            cpu->is_idle = 0;
         }
     }
 }
 
 void sched_init()
 {
-    spin_init(&load_lock, "load_lock");
     for (int i = 0; i < NCPU; i++)
     {
         spin_init(&cpus[i].sched_list.lock, "sched_list");
-        INIT_LIST_HEAD(&cpus[i].sched_list.run);
+        prio_array_init(&cpus[i].sched_list.run);
+        cpus[i].sched_list.fair = RB_ROOT_CACHED;
+        cpus[i].sched_list.min_vruntime = 0;
+        cpus[i].sched_list.load = 0;
         INIT_LIST_HEAD(&cpus[i].sched_list.out);
+        cpus[i].sched_list.nr_running = 0;
+        memset(&cpus[i].sched_list.stats, 0, sizeof(struct sched_stats));
+        cpus[i].is_idle = 0;
+        cpus[i].tick_stopped = 0;
+        cpus[i].prev = NULL;
+        cpus[i].need_resched = 0;
+        cpus[i].sched_list.curr_prio = MAX_PRIO;
+        cpus[i].sched_list.rt_time = 0;
+        cpus[i].sched_list.rt_period_start = 0;
+        cpus[i].sched_list.rt_throttled = 0;
     }
 }
 
@@ -155,12 +688,12 @@ void wakeup_process(struct thread_info *thread)
     // printk("Thread %s acquiring lock on cpu %d in wakeup\n", thread->name, cpuid());
     spin_lock(&thread->lock);
     thread->state = RUNNABLE;
-    add_runnable_task(thread);
+    add_runnable_task(thread, 1);
     spin_unlock(&thread->lock);
     // printk("Thread %s releasing lock on cpu %d in wakeup\n", thread->name, cpuid());
 }
 
-void kthread_create(void (*func)(void *), void *args, const char *name, int cpu_affinity)
+static struct thread_info *__kthread_create(void (*func)(void *), void *args, const char *name, int cpu_affinity)
 {
     if (cpu_affinity < NO_CPU_AFF || cpu_affinity >= NCPU)
     {
@@ -168,19 +701,36 @@ void kthread_create(void (*func)(void *), void *args, const char *name, int cpu_
                "the default value is 'NO_CPU_AFF'.\n"
                "The value you pass in is %d\n",
                cpu_affinity);
-        return;
+        return NULL;
     }
     struct thread_info *t = alloc_kthread();
     if (!t)
     {
         printk("kthread_create\n");
-        return;
+        return NULL;
     }
     t->func = func;
     t->args = args;
     strncpy(t->name, name, 16);
     t->cpu_affinity = cpu_affinity;
+    return t;
+}
+
+void kthread_create(void (*func)(void *), void *args, const char *name, int cpu_affinity)
+{
+    struct thread_info *t = __kthread_create(func, args, name, cpu_affinity);
+    if (t)
+        wakeup_process(t);
+}
 
+// 创建实时内核线程，policy 为 SCHED_FIFO 或 SCHED_RR，prio 越小优先级越高
+void kthread_create_rt(void (*func)(void *), void *args, const char *name, int cpu_affinity, int policy, int prio)
+{
+    struct thread_info *t = __kthread_create(func, args, name, cpu_affinity);
+    if (!t)
+        return;
+    if (policy == SCHED_NORMAL || sched_setscheduler(t, policy, prio) < 0)
+        printk("kthread_create_rt: bad policy %d prio %d for %s, use SCHED_NORMAL\n", policy, prio, name);
     wakeup_process(t);
 }
 
@@ -228,6 +778,33 @@ __attribute__((unused)) void debug_cpu_shed_list()
     printk("\nCPU shed list:\n");
     for (int i = 0; i < NCPU; i++)
     {
-        printk("cpu %d len %d\n", i, list_len(&cpus[i].sched_list.run));
+        printk("cpu %d nr_running %d bitmap %p\n", i, cpus[i].sched_list.nr_running, (uint64)cpus[i].sched_list.run.bitmap);
+    }
+}
+
+// 打印各 CPU 的调度统计，时间换算成微秒
+void sched_stats_show()
+{
+    static const char *bucket_name[SCHED_WAIT_BUCKETS] = {"<10us", "<100us", "<1ms", "<10ms", "<100ms", ">=100ms"};
+    struct sched_stats *st;
+    int i, j;
+
+    for (i = 0; i < NCPU; i++)
+    {
+        st = &cpus[i].sched_list.stats;
+        printk("cpu %d: switches %d (voluntary %d, involuntary %d) migrations %d idle %dus\n",
+               i, (int)st->nr_switches, (int)st->nr_voluntary, (int)st->nr_involuntary,
+               (int)st->nr_migrations, (int)(st->idle_time / 10));
+        printk("  runqueue wait:");
+        for (j = 0; j < SCHED_WAIT_BUCKETS; j++)
+            printk(" %s %d", bucket_name[j], (int)st->wait_hist[j]);
+        printk(", max %dus\n", (int)(st->wait_max / 10));
     }
 }
+
+// 统计是各 CPU 自己不加锁更新的，这里清零可能与更新交错，丢几次计数无所谓
+void sched_stats_reset()
+{
+    for (int i = 0; i < NCPU; i++)
+        memset(&cpus[i].sched_list.stats, 0, sizeof(struct sched_stats));
+}
@@ -7,10 +7,9 @@
 #include "lib/sleeplock.h"
 #include "mm/kmalloc.h"
 
-static ticks_t sys_ticks;
-
 // 我们对每个CPU都分配一个定时器,避免多 CPU 造成的竞争，
 // 同时，由于时钟中断后检查到期，不会产生调度，因此，也不存在加入|删除队列的竞争
+// （加入队列时需要关中断）
 struct list_head timer_queue[NCPU];
 
 struct thread_down
@@ -21,7 +20,6 @@ struct thread_down
 
 inline void time_init()
 {
-    sys_ticks = 0;
     for (uint32 i = 0; i < NCPU; i++)
     {
         INIT_LIST_HEAD(&timer_queue[i]);
@@ -52,9 +50,10 @@ static void timer_del(timer_t *t)
     kmem_cache_free(&timer_kmem_cache, t);
 }
 
+// 系统时间直接由 time 寄存器换算，不依赖某个 CPU 的时钟中断（NO_HZ 下 CPU0 可能很久不来中断）
 inline ticks_t get_cur_time()
 {
-    return sys_ticks;
+    return r_time() / TICK_INTERVAL;
 }
 
 // 每次时钟中断，都要检查是否到期
@@ -64,13 +63,14 @@ static void timer_try_wake()
     timer_t *t;
     timer_t *tmp;
     struct list_head *ct = &timer_queue[cpuid()];
+    ticks_t now = get_cur_time();
 
     list_for_each_entry_safe(t, tmp, ct, list)
     {
-        // printk("%d,%d\n", sys_ticks, t->init_time + t->during_time);
-        if (sys_ticks >= t->init_time + t->during_time) // 到期了
+        // printk("%d,%d\n", now, t->init_time + t->during_time);
+        if (now >= t->init_time + t->during_time) // 到期了
         {
-            t->init_time = sys_ticks;
+            t->init_time = now;
             if (t->count != NO_RESTRICT)
             {
                 t->count--;
@@ -87,28 +87,71 @@ static void timer_try_wake()
     }
 }
 // 现在是在中断的情况下，是绝对不允许睡眠的
+// 以前每 3 次时钟中断才检查一次，NO_HZ 下中断已经很少了，每次都检查
 inline void time_update()
 {
-    // 这个就算改不及时也没事，也就是说 CPU0改了后，
-    // 哪怕CPU1看到的是以前的，也就只差一个时钟中断而已，很快就来了。没必要使用自旋锁
-
-    // if (cpuid() == 0)
-    //     sys_ticks++;
-    // timer_try_wake();
-
-    if (cpuid() == 0)
-        sys_ticks++;
-    // TODO 每个cpu每3次唤醒一次，这样来说实际上是有点不能及时唤醒的，
-    // TODO 应该会差 1,2或者更多个（如果此时cpu还在关中断）时钟周期，但是这样可以大大减少唤醒次数
-    // TODO 这里没有必要对 sys_ticks 强加锁，这里仅仅暂时这样
-    if (sys_ticks % 3 == 0)
-        timer_try_wake();
+    timer_try_wake();
+}
+
+// 本 CPU 上最早到期的定时器对应的 time 寄存器值，最多 NOHZ_MAX_IDLE 之后
+static uint64 next_timer_event()
+{
+    timer_t *t;
+    uint64 now = r_time();
+    uint64 next = now + NOHZ_MAX_IDLE;
+    uint64 expire;
+
+    list_for_each_entry(t, &timer_queue[cpuid()], list)
+    {
+        expire = (t->init_time + t->during_time) * TICK_INTERVAL;
+        if (expire < next)
+            next = expire;
+    }
+    return next;
+}
+
+// 在时钟中断中调用：本 CPU 空闲，或者当前线程是唯一可运行的线程时，停掉周期时钟，
+// 下一次中断只为最早到期的定时器而来。返回 0 表示就绪队列中有线程在等待，不能停
+// 先置 tick_stopped 再检查队列，与 add_runnable_task 中先入队再检查 tick_stopped 配对
+int tick_nohz_stop()
+{
+    struct cpu *cpu = mycpu();
+
+    cpu->tick_stopped = 1;
+    __sync_synchronize();
+    if (cpu->sched_list.nr_running)
+    {
+        cpu->tick_stopped = 0;
+        return 0;
+    }
+    w_stimecmp(next_timer_event());
+    return 1;
+}
+
+// 重新打开周期时钟，需要关中断
+// 调度器切换到线程前、有线程入队到本 CPU 时、收到核间中断时调用
+void tick_restart()
+{
+    struct cpu *cpu = mycpu();
+
+    if (!cpu->tick_stopped)
+        return;
+    cpu->tick_stopped = 0;
+    w_stimecmp(r_time() + TICK_INTERVAL);
 }
 
 static void assign_cpu(timer_t *t)
 {
+    uint64 expire = (t->init_time + t->during_time) * TICK_INTERVAL;
+
+    // 关中断，防止与时钟中断中的 timer_try_wake 竞争，也防止迁移到别的 CPU
+    push_off();
     struct list_head *ct = &timer_queue[cpuid()];
     list_add_head(&t->list, ct);
+    // 周期时钟停了，stimecmp 可能在这个定时器之后，要提前
+    if (mycpu()->tick_stopped && expire < r_stimecmp())
+        w_stimecmp(expire);
+    pop_off();
     // printk("timer: %p assign_cpu-> %d\n", t->callback, cpuid());
 }
 
@@ -1,5 +1,10 @@
 #include "std/stddef.h"
 #include "core/proc.h"
+#include "core/sched.h"
+#include "core/syscall.h"
+#include "core/vm.h"
+#include "lib/string.h"
+#include "std/stdio.h"
 
 int do_debug(int a0, const char *a1, const void *a2, char *const a3[], uint64 a4, int a5)
 {
@@ -17,12 +22,49 @@ int do_debug(int a0, const char *a1, const void *a2, char *const a3[], uint64 a4
 
     // printk("a4: %p\n", a4);
     // printk("a5: %d\n", a5);
+    switch (a0)
+    {
+    case DEBUG_SCHED_STATS:
+        sched_stats_show();
+        return 0;
+    case DEBUG_SCHED_RESET:
+        sched_stats_reset();
+        return 0;
+    }
     return -ENOSYS;
 }
 
+// 子进程只复制页表，用户页面都和父进程共享，写的时候再复制，见 vm.c uvm_cow_copy
 int do_fork()
 {
-    return -ENOSYS;
+    struct thread_info *p = myproc(), *np;
+
+    if ((np = alloc_uthread()) == NULL)
+        return -1;
+
+    // 复制到一半失败的页表由 free_thread 一起释放
+    if ((np->task->mm.pgd = alloc_pgt()) == NULL ||
+        uvm_cow_copy(&p->task->mm, &np->task->mm) < 0)
+    {
+        free_thread(np);
+        printk("do_fork: out of memory\n");
+        return -1;
+    }
+
+    *np->tf = *p->tf;
+    np->tf->kernel_sp = Kernel_stack_top(np);
+    // 子进程中 fork 返回 0
+    np->tf->a0 = 0;
+
+    np->parent = p;
+    np->policy = p->policy;
+    np->prio = p->prio;
+    np->nice = p->nice;
+    np->weight = p->weight;
+    strncpy(np->name, p->name, sizeof(np->name));
+
+    wakeup_process(np);
+    return np->pid;
 }
 
 int do_exec(const char *path, char *const argv[])
@@ -3,9 +3,11 @@
 #include "core/proc.h"
 #include "core/trap.h"
 #include "core/sched.h"
+#include "core/vm.h"
 #include "dev/plic.h"
 #include "mm/memlayout.h"
 #include "dev/uart.h"
+#include "dev/clint.h"
 #include "core/timer.h"
 #include "lib/semaphore.h"
 extern void virtio_disk_intr();
@@ -36,21 +38,22 @@ static void timer_intr()
     time_update();
 
     struct thread_info *cur = myproc();
-    if (!cur)
+    if (cur && sched_tick(cur))
     {
-        // 当前没有进程，正在开中断的情况下等待
-        w_stimecmp(r_time() + 8000);
+        // 时间片用完（或者有更应该运行的线程）就让出 CPU
+        w_stimecmp(r_time() + TICK_INTERVAL);
+        yield();
         return;
     }
 
-    // ticks 为线程的私有变量，不需要加锁
-    cur->ticks--;
-
-    w_stimecmp(r_time() + 250000);
+#ifdef NO_HZ
+    // 当前没有进程，或者当前线程是本 CPU 唯一可运行的，不需要周期时钟了
+    if (tick_nohz_stop())
+        return;
+#endif
 
-    // 到期就让出 CPU
-    if (cur->ticks == 0)
-        yield();
+    // 当前没有进程，正在开中断的情况下等待
+    w_stimecmp(r_time() + (cur ? TICK_INTERVAL : 8000));
 }
 
 static inline void external_intr()
@@ -87,20 +90,25 @@ static inline void intr_handler(uint64 scause)
         timer_intr();
         break;
 
+    case SOFT_SCAUSE: // 核间中断：唤醒在 wfi 中等待的调度器（返回后调度器会重新检查队列），
+                      // 或者有线程入队到停了周期时钟的 CPU，需要重新打开时钟
+        clint_clear_ipi();
+        if (myproc())
+            tick_restart();
+        break;
+
     default:
         break;
     }
-}
 
+    // 有更高优先级的实时线程入队到本 CPU（可能就是刚才的中断唤醒的），返回前让出
+    if (mycpu()->need_resched && myproc())
+        yield();
+}
 
-#define E_SYSCALL 8L       // 系统调用
-#define E_INS_PF 12L       // 指令缺页
-#define E_LOAD_PF 13L      // 加载缺页
-#define E_STORE_AMO_PF 15L // 存储缺页
 
 static void excep_handler(uint64 scause)
 {
-    // uint64 stval;
     switch (scause)
     {
     case E_SYSCALL:
@@ -111,7 +119,8 @@ static void excep_handler(uint64 scause)
     case E_INS_PF:
     case E_LOAD_PF:
     case E_STORE_AMO_PF:
-        
+        // stval 是出错的虚拟地址
+        page_fault_handler(r_stval(), scause);
         break;
     default:
         printk("unknown scause: %p\n", scause);
@@ -120,16 +129,11 @@ static void excep_handler(uint64 scause)
 }
 
 // 这个函数仅在用户中断返回被调用
+// 带着 ASID 切换，不再刷新整个 TLB，见 vm.c switch_mm
 static inline void swtch_pgd(struct thread_info *next)
 {
     spin_lock(&next->task->mm.lock);
-    // 如果发生了进程切换
-    if (r_satp() != MAKE_SATP(next->task->mm.pgd))
-    {
-        sfence_vma();
-        w_satp(MAKE_SATP(next->task->mm.pgd));
-        sfence_vma();
-    }
+    switch_mm(&next->task->mm);
     spin_unlock(&next->task->mm.lock);
 }
 
@@ -149,6 +153,7 @@ __attribute__((noreturn)) void usertrapret()
     unsigned long x = r_sstatus();
     x &= ~SSTATUS_SPP; // clear SPP to 0 for user mode
     x |= SSTATUS_SPIE; // enable interrupts in user mode
+    x &= ~SSTATUS_VS_MASK; // 用户态不能用向量单元，见 lib/string.c rvv_begin
     w_sstatus(x);
 
     swtch_pgd(p);
@@ -192,16 +197,20 @@ void usertrap()
     assert(p != NULL, "usertrap: p is NULL\n");
 
     if (scause & (1ULL << 63))
+    {
         intr_handler(scause);
+        p->tf->epc = sepc;
+    }
     else
     {
         // 额外处理下如果是系统调用
         if (scause == E_SYSCALL)
             // 返回到系统调用的下一条指令，即越过 ecall
             sepc += 4;
+        // 处理之前就要保存好返回地址：fork 会复制 trapframe，子进程要从 ecall 的下一条指令开始
+        p->tf->epc = sepc;
         excep_handler(scause);
     }
 
-    p->tf->epc = sepc;
     usertrapret();
 }
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include "defs.h"
 #include "core/vm.h"
 #include "core/proc.h"
+#include "core/trap.h"
 
 // 内核页表
 pagetable_t kernel_pagetable;
@@ -34,8 +35,9 @@ pagetable_t kernel_pagetable;
 //  1       -- R
 //  0       -- V    (Valid)     仅当位 V 为 1 时，页表项才是有效的；
 
-// 返回最下面的那个页表项的地址,并根据 alloc 的值看是否决定分配
-static pte_t *walk(pagetable_t pagetable, uint64 va, int alloc)
+// 返回第 target 级（0 为最下面一级）的页表项的地址,并根据 alloc 的值看是否决定分配
+// 途中遇到大页的叶子页表项直接返回它，va 已经被这个大页映射了
+static pte_t *walk_level(pagetable_t pagetable, uint64 va, int alloc, int target)
 {
     if (va >= MAXVA)
     {
@@ -46,7 +48,7 @@ static pte_t *walk(pagetable_t pagetable, uint64 va, int alloc)
 
     int level;
 
-    for (level = 2; level > 0; level--)
+    for (level = 2; level > target; level--)
     {
         // 提取出虚拟地址的level级别的每9位，根据这个9位在当前页表(这个pagetable也在反复更新)中查找 pte
         pte_t *pte = &pagetable[PX(level, va)];
@@ -56,6 +58,8 @@ static pte_t *walk(pagetable_t pagetable, uint64 va, int alloc)
         // 只不过该实际页面的内容在不在内存中就是 swap 的事情了
         if (*pte & PTE_V)
         {
+            if (PTE_LEAF(*pte))
+                return pte;
             pagetable = (pagetable_t)PTE2PA(*pte);
         }
 
@@ -66,17 +70,22 @@ static pte_t *walk(pagetable_t pagetable, uint64 va, int alloc)
         else
         {
             // 如果不需要分配、或者已经没有页面可以分配了
-            if (!alloc || (pagetable = (pagetable_t)__alloc_page(0)) == NULL)
+            if (!alloc || (pagetable = (pagetable_t)__alloc_page(__GFP_ZERO)) == NULL)
                 return NULL;
-            // 需要分配的话上面 if 判断中已申请到一个页面
+            // 需要分配的话上面 if 判断中已申请到一个清零的页面
             // 注：申请到的页面地址是真实的物理地址
-            memset(pagetable, 0, PGSIZE);
             // 设置页表项的属性
             *pte = PA2PTE(pagetable) | PTE_V;
         }
     }
-    // 返回根据最后9位找到的 pte 地址
-    return &pagetable[PX(0, va)];
+    // 返回根据第 target 级的 9 位找到的 pte 地址
+    return &pagetable[PX(target, va)];
+}
+
+// 返回最下面的那个页表项的地址（va 在大页中时是大页的页表项）
+static pte_t *walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+    return walk_level(pagetable, va, alloc, 0);
 }
 
 // 为从 va 开始的虚拟地址创建 PTE（页表项），这些虚拟地址对应于从 pa 开始的物理地址。
@@ -84,10 +93,12 @@ static pte_t *walk(pagetable_t pagetable, uint64 va, int alloc)
 // 成功时返回 0，若 walk() 无法分配所需的页表页，则返回 -1。
 // 从 va 到 va + sz 的虚拟地址范围映射到从 pa 到 pa + sz 的物理地址范围。
 // 再次强调下，va 区域连续，pa 区域也连续的！！！。
-static int mappages(pagetable_t pagetable, uint64 va, uint64 pa, uint64 size, int perm)
+// huge 不为 0 时，va、pa 都按 1G/2M 对齐并且剩下的范围足够的地方用大页映射，少建页表、少占 TLB
+static int __mappages(pagetable_t pagetable, uint64 va, uint64 pa, uint64 size, int perm, int huge)
 {
     uint64 a, last;
     pte_t *pte;
+    int level;
     if ((va % PGSIZE) != 0)
         panic("mappages: va not aligned");
 
@@ -105,8 +116,16 @@ static int mappages(pagetable_t pagetable, uint64 va, uint64 pa, uint64 size, in
     spin_lock(&mem_map.lock);
     for (;;)
     {
-        if ((pte = walk(pagetable, a, 1)) == NULL)
+        // 能放下的最大一级页面
+        for (level = huge ? 2 : 0; level > 0; level--)
+            if (((a | pa) & (PXSIZE(level) - 1)) == 0 && last - a >= PXSIZE(level) - PGSIZE)
+                break;
+
+        if ((pte = walk_level(pagetable, a, 1, level)) == NULL)
+        {
+            spin_unlock(&mem_map.lock);
             return ERR;
+        }
 
         if (*pte & PTE_V)
             panic("vm.c mappages: remap");
@@ -114,24 +133,31 @@ static int mappages(pagetable_t pagetable, uint64 va, uint64 pa, uint64 size, in
         // 添加页面映射和权限信息
         *pte = PA2PTE(pa) | perm | PTE_V;
 
-        if (a == last)
+        if (last - a < PXSIZE(level))
             break;
-        a += PGSIZE;
-        pa += PGSIZE;
+        a += PXSIZE(level);
+        pa += PXSIZE(level);
     }
     spin_unlock(&mem_map.lock);
     return 0;
 }
 
+static int mappages(pagetable_t pagetable, uint64 va, uint64 pa, uint64 size, int perm)
+{
+    return __mappages(pagetable, va, pa, size, perm, 0);
+}
+
+// 内核的映射尽量用大页，只有权限边界（比如 etext）附近不对齐的部分用 4K 页面
+// 内核的映射在所有地址空间中都一样，标记为全局的
 static void kvm_map(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-    if (mappages(kpgtbl, va, pa, sz, perm) != 0)
+    if (__mappages(kpgtbl, va, pa, sz, perm | PTE_G, 1) != 0)
         panic("vm.c kvm_map: Error!");
 }
 
 inline pagetable_t alloc_pgt()
 {
-    return __alloc_page(0);
+    return __alloc_page(__GFP_ZERO);
 }
 
 // 内核虚存初始化
@@ -143,13 +169,14 @@ void kvm_init()
     if (!kpgtbl)
         panic("Failed to apply for kernel page table space!\n");
 
-    memset(kpgtbl, 0, PGSIZE);
-
     // 下面开始映射、大部分都是恒等映射
 
     // uart registers
     kvm_map(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
 
+    // CLINT，用于发送核间中断
+    kvm_map(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
     // virtio mmio disk interface
     kvm_map(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
@@ -175,11 +202,167 @@ void kvm_init()
     kernel_pagetable = kpgtbl;
 }
 
+// ASID：用户地址空间切换时 satp 带上各自的 ASID，TLB 表项按 ASID 区分，切换不用刷新整个 TLB
+// 内核的映射是全局的（PTE_G），所有地址空间共用，ASID 0 留给内核页表
+//
+// ASID 用完时进入新的一代（generation）：清空位图，各 CPU 正在用的 ASID 保留下来（reserved）
+// 在新的一代中仍然有效，其余的 mm 下次切换时重新分配；
+// 每个 CPU 在新的一代中第一次切换时刷新一次整个 TLB，之后同一代中的 ASID 不会被别的 mm 占用
+static int asid_bits;
+static uint64 asid_mask;
+static spinlock_t asid_lock;
+static uint64 asid_generation;
+static uint64 asid_map[(SATP_ASID_MASK + 1) / 64];
+static uint64 asid_cur; // 上次分配到的位置，从这里往后找
+static uint64 active_context[NCPU];   // 每个 CPU 正在用的 context，换代时被清 0
+static uint64 reserved_context[NCPU]; // 换代时各 CPU 正在用的 context
+static int flush_pending[NCPU];       // 换代后还没有刷新过 TLB
+
+#define ASID_GEN(ctx) ((ctx) >> asid_bits)
+
+// 写全 1 再读回来，看硬件实际支持几位 ASID
+static void asid_init()
+{
+    uint64 satp = r_satp();
+
+    w_satp(satp | (SATP_ASID_MASK << SATP_ASID_SHIFT));
+    asid_mask = (r_satp() >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+    w_satp(satp);
+
+    asid_bits = 0;
+    while (asid_mask >> asid_bits)
+        asid_bits++;
+    asid_generation = 1UL << asid_bits;
+}
+
+static inline int asid_test_and_set(uint64 asid)
+{
+    int old = (asid_map[asid / 64] >> (asid % 64)) & 1;
+    asid_map[asid / 64] |= 1UL << (asid % 64);
+    return old;
+}
+
+// 换代：重新开始分配，保留各 CPU 正在用的，所有 CPU 都要刷新 TLB
+// 需要持有 asid_lock
+static void flush_context()
+{
+    uint64 ctx;
+    int i;
+
+    memset(asid_map, 0, sizeof(asid_map));
+    asid_map[0] = 1; // ASID 0 是内核的
+    for (i = 0; i < NCPU; i++)
+    {
+        ctx = __sync_lock_test_and_set(&active_context[i], 0);
+        // 换代之后这个 CPU 还没切换过用户地址空间，它用的还是上一次保留的
+        if (ctx == 0)
+            ctx = reserved_context[i];
+        asid_test_and_set(ctx & asid_mask);
+        reserved_context[i] = ctx;
+        flush_pending[i] = 1;
+    }
+}
+
+// 如果 ctx 被某个 CPU 保留着，改成新的一代，返回是否找到
+// 需要持有 asid_lock
+static int check_update_reserved(uint64 ctx, uint64 newctx)
+{
+    int i, hit = 0;
+
+    for (i = 0; i < NCPU; i++)
+    {
+        if (reserved_context[i] == ctx)
+        {
+            reserved_context[i] = newctx;
+            hit = 1;
+        }
+    }
+    return hit;
+}
+
+// 为 mm 在当前这一代中分配 ASID，旧的 ASID 没被占用的话继续用
+// 需要持有 asid_lock
+static uint64 new_context(struct mm_struct *mm)
+{
+    uint64 ctx = mm->context, asid = ctx & asid_mask;
+
+    if (ctx != 0)
+    {
+        if (check_update_reserved(ctx, asid_generation | asid))
+            return asid_generation | asid;
+        if (!asid_test_and_set(asid))
+            return asid_generation | asid;
+    }
+
+    for (asid = asid_cur + 1; asid <= asid_mask; asid++)
+        if (!asid_test_and_set(asid))
+            goto found;
+
+    // 用完了，换代，保留的之外从头开始找
+    asid_generation += 1UL << asid_bits;
+    flush_context();
+    for (asid = 1; asid <= asid_mask; asid++)
+        if (!asid_test_and_set(asid))
+            goto found;
+    panic("new_context: no asid\n");
+
+found:
+    asid_cur = asid;
+    return asid_generation | asid;
+}
+
+// 切换到 mm 的用户地址空间
+// mm 的 ASID 还是当前这一代的，直接带着它写 satp，不用刷新 TLB
+void switch_mm(struct mm_struct *mm)
+{
+    int cpu = cpuid();
+    uint64 ctx, old;
+
+    // 硬件不支持 ASID，只能刷新整个 TLB
+    if (asid_bits == 0)
+    {
+        if (r_satp() != MAKE_SATP(mm->pgd))
+        {
+            sfence_vma();
+            w_satp(MAKE_SATP(mm->pgd));
+            sfence_vma();
+        }
+        return;
+    }
+
+    // 快速路径：还是这一代的，且这期间没有换代（换代会把 active_context 清 0）
+    ctx = mm->context;
+    old = active_context[cpu];
+    if (old && ASID_GEN(ctx) == ASID_GEN(asid_generation) &&
+        __sync_bool_compare_and_swap(&active_context[cpu], old, ctx))
+        goto switch_satp;
+
+    spin_lock(&asid_lock);
+    ctx = mm->context;
+    if (ASID_GEN(ctx) != ASID_GEN(asid_generation))
+    {
+        ctx = new_context(mm);
+        mm->context = ctx;
+    }
+    if (flush_pending[cpu])
+    {
+        flush_pending[cpu] = 0;
+        sfence_vma();
+    }
+    active_context[cpu] = ctx;
+    spin_unlock(&asid_lock);
+
+switch_satp:
+    if (r_satp() != MAKE_SATP_ASID(mm->pgd, ctx & asid_mask))
+        w_satp(MAKE_SATP_ASID(mm->pgd, ctx & asid_mask));
+}
+
 // 将硬件页表寄存器 satp 切换到内核的页表（stap寄存器保存页表地址），
 // 并启用分页功能。
 void kvm_init_hart()
 {
-    w_sstatus(SSTATUS_SUM);
+    // 只加上 SUM，不覆盖 sstatus 中的其他状态
+    w_sstatus(r_sstatus() | SSTATUS_SUM);
     // 等待之前对页表内存的任何写操作完成。
     sfence_vma();
 
@@ -189,6 +372,22 @@ void kvm_init_hart()
 
     // 刷新TLB（翻译后备缓冲区）中的过期条目。
     sfence_vma();
+
+    // 各个 hart 都一样，由 0 号初始化
+    if (cpuid() == 0)
+    {
+        spin_init(&asid_lock, "asid");
+        asid_init();
+        asid_map[0] = 1;
+    }
+}
+
+// 用户页表的前 KPGD_SHARED 个顶层页表项直接复制自内核页表，指向的下一级页表是和内核共用的
+#define KPGD_SHARED 8
+
+static inline int is_kernel_pgd_entry(pagetable_t pgd, int i)
+{
+    return i < KPGD_SHARED && pgd[i] == kernel_pagetable[i];
 }
 
 // Load the user initcode into address 0x200,000,000 of pagetable,
@@ -200,21 +399,51 @@ void uvmfirst(struct thread_info *init, uchar *src, uint sz)
     assert(sz <= PGSIZE, "uvmfirst: more than a page\n");
 
     // TODO 我们暂时直接首次复制顶层的内核页表，将其添加到用户页表中
-    memcpy(init->task->mm.pgd, kernel_pagetable, PGSIZE / 64);
+    memcpy(init->task->mm.pgd, kernel_pagetable, KPGD_SHARED * sizeof(pte_t));
 
     // 代码页
-    mem = __alloc_page(0);
+    mem = __alloc_page(__GFP_ZERO);
     mappages(init->task->mm.pgd, USER_TEXT_BASE & 0xfffffffffffff000, (uint64)mem, PGSIZE, PTE_R | PTE_X | PTE_U);
     memcpy(mem, src, sz);
 
     // 栈
-    mem = __alloc_page(0);
+    mem = __alloc_page(__GFP_ZERO);
     mappages(init->task->mm.pgd, USER_STACK_TOP & 0xfffffffffffff000, (uint64)mem, PGSIZE, PTE_R | PTE_W | PTE_U);
 
     init->tf->epc = USER_TEXT_BASE;
     init->tf->sp = USER_STACK_TOP;
 }
 
+// 释放第 level 级的用户页表，以及映射的页面的一次引用
+static void uvm_free_level(pagetable_t pgt, int level)
+{
+    pte_t pte;
+    int i;
+
+    for (i = 0; i < 512; i++)
+    {
+        pte = pgt[i];
+        if (!(pte & PTE_V))
+            continue;
+        if (level == 2 && is_kernel_pgd_entry(pgt, i))
+            continue;
+        if (pte & (PTE_R | PTE_W | PTE_X))
+            __free_page((void *)PTE2PA(pte));
+        else
+            uvm_free_level((pagetable_t)PTE2PA(pte), level - 1);
+    }
+    __free_page(pgt);
+}
+
+// 释放整个用户地址空间，包括顶层页表
+void uvm_free(struct mm_struct *mm)
+{
+    if (!mm->pgd)
+        return;
+    uvm_free_level(mm->pgd, 2);
+    mm->pgd = NULL;
+}
+
 // 设置页面为 cow
 void set_cow_page(pte_t *pte)
 {
@@ -252,11 +481,13 @@ static struct vm_area_struct *find_vma(struct mm_struct *mm, uint64 addr)
 
 static int vma_ops_fault(struct mm_struct *mm, struct vm_area_struct *vm, uint64 addr)
 {
+    if (!vm->vm_ops || !vm->vm_ops->fault)
+        return -1;
+    vm->vm_ops->fault(mm, vm, addr);
+    return 0;
 }
 
-static int vm_file_load();
-
-static int vm_rx_fault(struct mm_struct *mm, struct vm_area_struct *vm, uint64 addr)
+__attribute__((unused)) static int vm_rx_fault(struct mm_struct *mm, struct vm_area_struct *vm, uint64 addr)
 {
     if (TEST_FLAG(&vm->vm_prot, PROT_LAZY))
     {
@@ -264,8 +495,8 @@ static int vm_rx_fault(struct mm_struct *mm, struct vm_area_struct *vm, uint64 a
     }
     else if (vm->vm_file)
     {
-        uint32 off = addr - vm->vm_start;
-        vm_file_load();
+        // TODO 从文件 vm->vm_pgoff 处读入，文件映射暂时还没有实现
+        panic("vm_rx_fault: file mapping\n");
     }
     else
     {
@@ -274,11 +505,136 @@ static int vm_rx_fault(struct mm_struct *mm, struct vm_area_struct *vm, uint64 a
     return 0;
 }
 
+// 复制第 level 级的用户页表 old 到 new：
+// 下级页表各自复制一份，叶子页面不复制，父子共享同一个物理页面并增加引用计数。
+// 可写的页面在父子两边都改成只读的 COW 页面，等到有一方写的时候再复制
+// 需要持有父进程的 mm->lock
+static int uvm_cow_copy_level(pagetable_t old, pagetable_t new, int level)
+{
+    pagetable_t child;
+    pte_t pte;
+    int i;
+
+    for (i = 0; i < 512; i++)
+    {
+        pte = old[i];
+        if (!(pte & PTE_V))
+            continue;
+
+        // 和内核共用的部分照抄
+        if (level == 2 && is_kernel_pgd_entry(old, i))
+        {
+            new[i] = pte;
+            continue;
+        }
+
+        if (!PTE_LEAF(pte))
+        {
+            if ((child = alloc_pgt()) == NULL)
+                return -1;
+            new[i] = PA2PTE(child) | PTE_V;
+            if (uvm_cow_copy_level((pagetable_t)PTE2PA(pte), child, level - 1) < 0)
+                return -1;
+            continue;
+        }
+
+        // 用户的映射只有 4K 页面
+        assert(level == 0, "uvm_cow_copy: huge user page\n");
+        if (pte & (PTE_W | PTE_COW))
+            set_cow_page(&old[i]);
+        else
+            page_push(get_page_struct(PTE2PA(pte)));
+        new[i] = old[i];
+    }
+    return 0;
+}
+
+// fork 时复制地址空间，父子共享所有的用户页面，只复制页表
+// new 的 pgd 需要已经分配好（清零的）
+int uvm_cow_copy(struct mm_struct *old, struct mm_struct *new)
+{
+    uint64 asid;
+    int ret;
+
+    spin_lock(&old->lock);
+    ret = uvm_cow_copy_level(old->pgd, new->pgd, 2);
+
+    // 父进程可写的页面都改成了只读，但之前运行过它的 CPU 上可能还留着这个 ASID 的可写 TLB 表项，
+    // 我们没有 IPI 去刷新别的 CPU，干脆丢掉这个 ASID，下次切换时重新分配一个（新分配的 ASID 在哪个 CPU 上都没有表项）
+    // 本 CPU 还在用旧的 ASID 直到返回用户态，先刷新掉
+    asid = old->context & asid_mask;
+    old->context = 0;
+    spin_unlock(&old->lock);
+
+    if (asid_bits)
+        sfence_vma_asid(asid);
+    else
+        sfence_vma();
+
+    new->size = old->size;
+    new->start_code = old->start_code;
+    new->end_code = old->end_code;
+    new->start_data = old->start_data;
+    new->end_data = old->end_data;
+    new->start_brk = old->start_brk;
+    new->end_brk = old->end_brk;
+    new->start_stack = old->start_stack;
+    return ret;
+}
+
+// 处理对 COW 页面的写：页面只剩自己在用就直接恢复写权限，否则复制一份
+// 需要持有 mm->lock
+static int cow_fault(pte_t *pte)
+{
+    uint64 pa = PTE2PA(*pte);
+    int flags = PTE_FLAGS(*pte);
+    void *mem;
+
+    // 引用计数为 0 说明别的地址空间都已经复制走了
+    if (page_count(get_page_struct(pa)) == 0)
+    {
+        clear_cow_page(pte);
+        *pte |= PTE_W;
+        return 0;
+    }
+
+    if ((mem = __alloc_page(0)) == NULL)
+        return -1;
+    memcpy(mem, (void *)pa, PGSIZE);
+    *pte = PA2PTE(mem) | ((flags | PTE_W) & ~PTE_COW);
+    // 放掉对原来页面的引用，如果对方在此期间也复制走了，这里就是最后一个，会被释放
+    __free_page((void *)pa);
+    return 0;
+}
+
 void page_fault_handler(uint64 fault_addr, uint64 scause)
 {
-    printk("page_fault_handler\n");
     struct task_struct *t = myproc()->task;
-    struct vm_area_struct *v = find_vma(&t->mm, fault_addr);
+    struct vm_area_struct *v;
+    pte_t *pte;
+
+    // 写时复制
+    if (scause == E_STORE_AMO_PF)
+    {
+        spin_lock(&t->mm.lock);
+        pte = walk(t->mm.pgd, fault_addr, 0);
+        if (pte && (*pte & PTE_V) && (*pte & PTE_U) && (is_cow_page(pte) || (*pte & PTE_W)))
+        {
+            // 已经可写了的话是别的线程先处理过了，只是本 CPU 的 TLB 还是旧的
+            if (is_cow_page(pte) && cow_fault(pte) < 0)
+            {
+                spin_unlock(&t->mm.lock);
+                // TODO 杀死进程，不过我们暂时先报错
+                panic("page_fault_handler: cow out of memory %p\n", fault_addr);
+            }
+            spin_unlock(&t->mm.lock);
+            sfence_vma_page(PGROUNDDOWN(fault_addr), t->mm.context & asid_mask);
+            return;
+        }
+        spin_unlock(&t->mm.lock);
+    }
+
+    v = find_vma(&t->mm, fault_addr);
     if (!v)
     {
         // TODO 杀死进程，不过我们暂时先报错
@@ -286,15 +642,17 @@ void page_fault_handler(uint64 fault_addr, uint64 scause)
         panic("page_fault_handler: illegal addr %p\n", fault_addr);
         // return;
     }
-    pte_t *pte = walk(t->mm.pgd, fault_addr, 0);
-    if (pte && ~is_cow_page(pte))
+    pte = walk(t->mm.pgd, fault_addr, 0);
+    if (pte && (*pte & PTE_V))
     {
+        // 页面在，权限不对
         // TODO 杀死进程，不过我们暂时先报错
-        // kill_process(current); // 非法地址，终止进程
         panic("page_fault_handler: illegal addr %p\n", fault_addr);
         // return;
     }
 
-    v->vm_ops->fault(&t->mm, v, fault_addr);
-    sfence_vma();
-}
\ No newline at end of file
+    if (vma_ops_fault(&t->mm, v, fault_addr) < 0)
+        panic("page_fault_handler: no fault handler %p\n", fault_addr);
+    // 只刷新这个地址空间中出错的这一页
+    sfence_vma_page(PGROUNDDOWN(fault_addr), t->mm.context & asid_mask);
+}
@@ -71,7 +71,7 @@ void work_queue_init()
     {
         sem_init(&work_queue[i].count, 0, "work_count");
         fifo_init(&work_queue[i].queue);
-        kthread_create(kthread_work_handler, NULL, "work_handler",i);
+        kthread_create_rt(kthread_work_handler, NULL, "work_handler", i, SCHED_RR, KTHREAD_PRIO_WORK);
     }
 }
 
@@ -1,23 +1,297 @@
-// #include "lib/rbtree.h"
-
-// #define RBTBLACK	(0)
-// #define RBTRED		(1)
-
-// /*
-//  * RBTree control structure
-//  */
-// struct rb_tree
-// {
-// 	rb_node    *root;			/* root node, or RBTNIL if tree is empty */
-
-// 	/* Remaining fields are constant after rbt_create */
-
-// 	uint16		node_size;		/* actual size of tree nodes */
-// 	/* The caller-supplied manipulation functions */
-// 	rbt_comparator comparator;
-// 	rbt_combiner combiner;
-// 	rbt_allocfunc allocfunc;
-// 	rbt_freefunc freefunc;
-// 	/* Passthrough arg passed to all manipulation functions */
-// 	void	   *arg;
-// };
\ No newline at end of file
+#include "lib/rbtree.h"
+
+// 红黑树性质：
+// 1. 节点非红即黑，根为黑
+// 2. 红节点的孩子都是黑的（NULL 视为黑）
+// 3. 任一节点到其所有叶子的路径上黑节点数相同
+
+static inline int rb_is_red(const struct rb_node *node)
+{
+    return node && node->color == RB_RED;
+}
+
+static inline int rb_is_black(const struct rb_node *node)
+{
+    return !rb_is_red(node);
+}
+
+// 用 new 替换 old 在其父节点（或根）中的位置
+static inline void rb_change_child(struct rb_node *old, struct rb_node *new,
+                                   struct rb_node *parent, struct rb_root *root)
+{
+    if (!parent)
+        root->node = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+}
+
+// 左旋：x 的右孩子 y 上来顶替 x，x 成为 y 的左孩子，y 原来的左子树挂到 x 的右边
+static void rb_rotate_left(struct rb_node *x, struct rb_root *root)
+{
+    struct rb_node *y = x->right;
+    struct rb_node *parent = x->parent;
+
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    y->left = x;
+    y->parent = parent;
+    rb_change_child(x, y, parent, root);
+    x->parent = y;
+}
+
+// 右旋：与左旋对称
+static void rb_rotate_right(struct rb_node *x, struct rb_root *root)
+{
+    struct rb_node *y = x->left;
+    struct rb_node *parent = x->parent;
+
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    y->right = x;
+    y->parent = parent;
+    rb_change_child(x, y, parent, root);
+    x->parent = y;
+}
+
+// 插入后修正颜色，node 已经由 rb_link_node 挂到树上
+void rb_insert_color(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *parent, *gparent, *uncle;
+
+    while ((parent = node->parent) && rb_is_red(parent))
+    {
+        // 父节点是红的，那它一定不是根，祖父一定存在
+        gparent = parent->parent;
+        if (parent == gparent->left)
+        {
+            uncle = gparent->right;
+            // 叔叔是红的：父、叔变黑，祖父变红，继续向上
+            if (rb_is_red(uncle))
+            {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            // 叔叔是黑的，node 是右孩子：先转成左孩子的情况
+            if (node == parent->right)
+            {
+                rb_rotate_left(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_right(gparent, root);
+        }
+        else
+        {
+            uncle = gparent->left;
+            if (rb_is_red(uncle))
+            {
+                parent->color = RB_BLACK;
+                uncle->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left)
+            {
+                rb_rotate_right(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_left(gparent, root);
+        }
+    }
+    root->node->color = RB_BLACK;
+}
+
+// 删除后修正，node 为顶替上来的节点（可能为 NULL），parent 为其父节点
+static void rb_erase_color(struct rb_node *node, struct rb_node *parent, struct rb_root *root)
+{
+    struct rb_node *sibling;
+
+    while (node != root->node && rb_is_black(node))
+    {
+        if (node == parent->left)
+        {
+            sibling = parent->right;
+            // 兄弟是红的：转成兄弟是黑的情况
+            if (rb_is_red(sibling))
+            {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_left(parent, root);
+                sibling = parent->right;
+            }
+            // 兄弟的两个孩子都是黑的：兄弟变红，问题上移
+            if (rb_is_black(sibling->left) && rb_is_black(sibling->right))
+            {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            // 兄弟的右孩子是黑的（左孩子红）：转成右孩子红的情况
+            if (rb_is_black(sibling->right))
+            {
+                sibling->left->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rb_rotate_right(sibling, root);
+                sibling = parent->right;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->right->color = RB_BLACK;
+            rb_rotate_left(parent, root);
+            node = root->node;
+            break;
+        }
+        else
+        {
+            sibling = parent->left;
+            if (rb_is_red(sibling))
+            {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_right(parent, root);
+                sibling = parent->left;
+            }
+            if (rb_is_black(sibling->left) && rb_is_black(sibling->right))
+            {
+                sibling->color = RB_RED;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (rb_is_black(sibling->left))
+            {
+                sibling->right->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rb_rotate_left(sibling, root);
+                sibling = parent->left;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->left->color = RB_BLACK;
+            rb_rotate_right(parent, root);
+            node = root->node;
+            break;
+        }
+    }
+    if (node)
+        node->color = RB_BLACK;
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root)
+{
+    struct rb_node *child, *parent, *successor;
+    int color;
+
+    if (node->left && node->right)
+    {
+        // 有两个孩子：用后继节点（右子树最小）顶替 node 的位置
+        successor = node->right;
+        while (successor->left)
+            successor = successor->left;
+
+        child = successor->right;
+        parent = successor->parent;
+        color = successor->color;
+
+        if (parent == node)
+            parent = successor;
+        else
+        {
+            if (child)
+                child->parent = parent;
+            parent->left = child;
+            successor->right = node->right;
+            node->right->parent = successor;
+        }
+
+        successor->parent = node->parent;
+        successor->color = node->color;
+        successor->left = node->left;
+        node->left->parent = successor;
+        rb_change_child(node, successor, node->parent, root);
+    }
+    else
+    {
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        color = node->color;
+
+        if (child)
+            child->parent = parent;
+        rb_change_child(node, child, parent, root);
+    }
+
+    if (color == RB_BLACK)
+        rb_erase_color(child, parent, root);
+    RB_CLEAR_NODE(node);
+}
+
+struct rb_node *rb_first(const struct rb_root *root)
+{
+    struct rb_node *n = root->node;
+    if (!n)
+        return NULL;
+    while (n->left)
+        n = n->left;
+    return n;
+}
+
+struct rb_node *rb_last(const struct rb_root *root)
+{
+    struct rb_node *n = root->node;
+    if (!n)
+        return NULL;
+    while (n->right)
+        n = n->right;
+    return n;
+}
+
+struct rb_node *rb_next(const struct rb_node *node)
+{
+    struct rb_node *parent;
+
+    // 有右子树：右子树中最小的
+    if (node->right)
+    {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return (struct rb_node *)node;
+    }
+
+    // 否则向上找到第一个 node 位于其左子树的祖先
+    while ((parent = node->parent) && node == parent->right)
+        node = parent;
+    return parent;
+}
+
+struct rb_node *rb_prev(const struct rb_node *node)
+{
+    struct rb_node *parent;
+
+    if (node->left)
+    {
+        node = node->left;
+        while (node->right)
+            node = node->right;
+        return (struct rb_node *)node;
+    }
+
+    while ((parent = node->parent) && node == parent->left)
+        node = parent;
+    return parent;
+}
@@ -70,6 +70,20 @@ void spin_lock(spinlock_t *lock)
     __sync_synchronize();
 }
 
+// 尝试加锁，拿不到（包括自己已经持有）立即返回 0，不自旋等待
+int spin_trylock(spinlock_t *lock)
+{
+    push_off();
+    if (holding(lock) || __sync_lock_test_and_set(&lock->lock, SPIN_LOCKED) != 0)
+    {
+        pop_off();
+        return 0;
+    }
+    lock->cpuid = cpuid();
+    __sync_synchronize();
+    return 1;
+}
+
 void spin_unlock(spinlock_t *lock)
 {
     if (!holding(lock))
@@ -1,4 +1,7 @@
 #include "std/stddef.h"
+#include "lib/string.h"
+#include "lib/spinlock.h"
+#include "riscv.h"
 
 /*
  *
@@ -8,27 +11,206 @@
  * strncmp、strncpy、safestrcpy、strlen
  * 暂时没有完全实现，用到再说
  *
+ * 内存操作按 8 字节一次、一轮 8 个字处理，头尾不对齐的部分按字节处理
+ * RISC-V 不对齐的访存可能陷入异常，src 与 dst 对 8 取余不同时只能按字节处理
+ * 启动时检测到 V 扩展的话，大块的 memcpy/memset 走向量指令（string_rvv.S）
+ *
  */
 
+#define WSIZE sizeof(uint64)
+#define WMASK (WSIZE - 1)
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+// 字中是否有为 0 的字节
+#define haszero(x) (((x) - ONES) & ~(x) & HIGHS)
+
+// 启动时在机器模式下检测 V 扩展（start.c）
+int rvv_enabled;
+
+extern void *memcpy_rvv(void *dst, const void *src, uint64 n);
+extern void *memset_rvv(void *dst, int c, uint64 n);
+
+// 向量寄存器不随上下文切换保存，用的时候要关中断，不能被切走或被中断处理打断
+static int use_rvv(uint64 n)
+{
+    return rvv_enabled && n >= RVV_THRESHOLD;
+}
+
+// 向量单元平时是关着的，只在关中断的这段时间里打开：
+// 用户态执行向量指令会陷入非法指令，读不到内核留在向量寄存器中的数据（别的地址空间的页面、块缓存），
+// 内核也就不用保存、恢复用户的向量状态
+static inline void rvv_begin()
+{
+    push_off();
+    w_sstatus(r_sstatus() | SSTATUS_VS_INITIAL);
+}
+
+static inline void rvv_end()
+{
+    w_sstatus(r_sstatus() & ~SSTATUS_VS_MASK);
+    pop_off();
+}
+
 // 在 dst 处设置 n 个 c
 void *memset(void *dst, int c, uint64 n)
 {
-    char *cdst = (char *)dst;
-    int i;
-    for (i = 0; i < n; i++)
-        cdst[i] = c;
+    uchar *d = (uchar *)dst;
+    uint64 *w, word;
+
+    if (use_rvv(n))
+    {
+        rvv_begin();
+        memset_rvv(dst, c, n);
+        rvv_end();
+        return dst;
+    }
+
+    for (; n && ((uint64)d & WMASK); n--)
+        *d++ = c;
+
+    word = (uchar)c * ONES;
+    w = (uint64 *)d;
+    for (; n >= 8 * WSIZE; n -= 8 * WSIZE, w += 8)
+    {
+        w[0] = word;
+        w[1] = word;
+        w[2] = word;
+        w[3] = word;
+        w[4] = word;
+        w[5] = word;
+        w[6] = word;
+        w[7] = word;
+    }
+    for (; n >= WSIZE; n -= WSIZE)
+        *w++ = word;
+
+    d = (uchar *)w;
+    while (n--)
+        *d++ = c;
     return dst;
 }
 
+// 从前往后复制，memmove 在 dst 在前时也用它
+static void copy_forward(uchar *d, const uchar *s, uint64 n)
+{
+    uint64 *wd;
+    const uint64 *ws;
+
+    if ((((uint64)d ^ (uint64)s) & WMASK) == 0)
+    {
+        for (; n && ((uint64)d & WMASK); n--)
+            *d++ = *s++;
+
+        wd = (uint64 *)d;
+        ws = (const uint64 *)s;
+        for (; n >= 8 * WSIZE; n -= 8 * WSIZE, wd += 8, ws += 8)
+        {
+            wd[0] = ws[0];
+            wd[1] = ws[1];
+            wd[2] = ws[2];
+            wd[3] = ws[3];
+            wd[4] = ws[4];
+            wd[5] = ws[5];
+            wd[6] = ws[6];
+            wd[7] = ws[7];
+        }
+        for (; n >= WSIZE; n -= WSIZE)
+            *wd++ = *ws++;
+        d = (uchar *)wd;
+        s = (const uchar *)ws;
+    }
+    while (n--)
+        *d++ = *s++;
+}
+
+// 从后往前复制，d、s 指向末尾
+static void copy_backward(uchar *d, const uchar *s, uint64 n)
+{
+    uint64 *wd;
+    const uint64 *ws;
+
+    if ((((uint64)d ^ (uint64)s) & WMASK) == 0)
+    {
+        for (; n && ((uint64)d & WMASK); n--)
+            *--d = *--s;
+
+        wd = (uint64 *)d;
+        ws = (const uint64 *)s;
+        for (; n >= WSIZE; n -= WSIZE)
+            *--wd = *--ws;
+        d = (uchar *)wd;
+        s = (const uchar *)ws;
+    }
+    while (n--)
+        *--d = *--s;
+}
+
 void *memcpy(void *dst, const void *src, uint64 n)
 {
-    unsigned char *_dst = (unsigned char *)dst;
-    const unsigned char *_src = (const unsigned char *)src;
+    if (use_rvv(n))
+    {
+        rvv_begin();
+        memcpy_rvv(dst, src, n);
+        rvv_end();
+        return dst;
+    }
+    copy_forward((uchar *)dst, (const uchar *)src, n);
+    return dst; // 返回目标指针
+}
+
+// 区域可以重叠
+void *memmove(void *dst, const void *src, uint64 n)
+{
+    uchar *d = (uchar *)dst;
+    const uchar *s = (const uchar *)src;
 
-    for (uint64 i = 0; i < n; i++)
-        _dst[i] = _src[i];
+    if (d == s || n == 0)
+        return dst;
+    // dst 在 src 前面，或者两者不重叠，从前往后复制不会覆盖还没读的数据
+    if (d < s || d >= s + n)
+        return memcpy(dst, src, n);
+    copy_backward(d + n, s + n, n);
+    return dst;
+}
+
+int memcmp(const void *v1, const void *v2, uint64 n)
+{
+    const uchar *s1 = (const uchar *)v1;
+    const uchar *s2 = (const uchar *)v2;
 
-    return _dst; // 返回目标指针
+    if ((((uint64)s1 ^ (uint64)s2) & WMASK) == 0)
+    {
+        for (; n && ((uint64)s1 & WMASK); n--, s1++, s2++)
+            if (*s1 != *s2)
+                return *s1 - *s2;
+        // 整字相等就跳过，不等的字留给下面按字节找出第一个不同的
+        for (; n >= WSIZE && *(const uint64 *)s1 == *(const uint64 *)s2; n -= WSIZE)
+        {
+            s1 += WSIZE;
+            s2 += WSIZE;
+        }
+    }
+    for (; n; n--, s1++, s2++)
+        if (*s1 != *s2)
+            return *s1 - *s2;
+    return 0;
+}
+
+// 对齐之后按字找结尾的 0，对齐的字不会跨页，多读的几个字节不会出错
+uint64 strlen(const char *str)
+{
+    const char *p = str;
+    const uint64 *w;
+
+    for (; (uint64)p & WMASK; p++)
+        if (*p == '\0')
+            return p - str;
+
+    for (w = (const uint64 *)p; !haszero(*w); w++)
+        ;
+    for (p = (const char *)w; *p; p++)
+        ;
+    return p - str;
 }
 
 int strdup(void *dst, const void *src)
@@ -1,6 +1,9 @@
 #include "mm/slab.h"
+#include "mm/kmalloc.h"
 #include "lib/math.h"
 #include "mm/page.h"
+#include "mm/mm.h"
+#include "mm/buddy.h"
 #include "core/proc.h"
 #include "dev/blk/buf.h"
 #include "core/timer.h"
@@ -8,28 +11,32 @@
 #include "../fs/easyfs/easyfs.h"
 #include "fs/file.h"
 
-struct kmem_cache kmalloc16;
-struct kmem_cache kmalloc32;
-struct kmem_cache kmalloc64;
-struct kmem_cache kmalloc128;
-struct kmem_cache kmalloc256;
-struct kmem_cache kmalloc512;
-struct kmem_cache kmalloc1024;
-struct kmem_cache kmalloc2048;
-struct kmem_cache kmalloc4096;
-struct kmem_cache kmalloc8192;
-struct kmem_cache *kmalloc_caches[] = {
-    [0] & kmalloc16,
-    [1] & kmalloc32,
-    [2] & kmalloc64,
-    [3] & kmalloc128,
-    [4] & kmalloc256,
-    [5] & kmalloc512,
-    [6] & kmalloc1024,
-    [7] & kmalloc2048,
-    [8] & kmalloc4096,
-    [9] & kmalloc8192,
-};
+// 通用缓存按大小分级，间隔大约 12.5%：
+// 128 以内按 16 递增；之后每个 (2^g, 2^(g+1)] 区间等分成 8 级
+// 16 32 48 ... 128 | 144 160 ... 256 | 288 320 ... 512 | ... | 4608 5120 ... 8192
+struct kmem_cache kmalloc_caches[KMALLOC_NR_CLASSES];
+
+// 第 idx 级的对象大小
+static uint32 kmalloc_class_size(int idx)
+{
+    int g;
+    if (idx < KMALLOC_SMALL_CLASSES)
+        return (idx + 1) * KMALLOC_MIN_SIZE;
+    idx -= KMALLOC_SMALL_CLASSES;
+    g = 7 + idx / 8;
+    return (1U << g) + (idx % 8 + 1) * (1U << (g - 3));
+}
+
+// 能放下 size 字节的最小一级
+static int kmalloc_index(uint32 size)
+{
+    int g;
+    if (size <= KMALLOC_SMALL_MAX)
+        return (size + KMALLOC_MIN_SIZE - 1) / KMALLOC_MIN_SIZE - 1;
+    // size 落在 (2^g, 2^(g+1)] 中
+    g = calculate_order(size) - 1;
+    return KMALLOC_SMALL_CLASSES + (g - 7) * 8 + ((size - 1 - (1U << g)) >> (g - 3));
+}
 
 // 专用缓存
 struct kmem_cache task_struct_kmem_cache;
@@ -45,41 +52,69 @@ struct kmem_cache vma_kmem_cache;
 
 void kmalloc_init()
 {
-    kmem_cache_create(&kmalloc16, "kmalloc-16", 16, 0);
-    kmem_cache_create(&kmalloc32, "kmalloc-32", 32, 0);
-    kmem_cache_create(&kmalloc64, "kmalloc-64", 64, 0);
-    kmem_cache_create(&kmalloc128, "kmalloc-128", 128, 0);
-    kmem_cache_create(&kmalloc256, "kmalloc-256", 256, 0);
-    kmem_cache_create(&kmalloc512, "kmalloc-512", 512, 0);
-    kmem_cache_create(&kmalloc1024, "kmalloc-1024", 1024, 0);
-    kmem_cache_create(&kmalloc2048, "kmalloc-2048", 2048, 0);
-    kmem_cache_create(&kmalloc4096, "kmalloc-4096", 4096, 0);
-    kmem_cache_create(&kmalloc8192, "kmalloc-8192", 8192, 0);
+    int i, n;
+    uint32 size;
+    char name[CACHE_MAX_NAME_LEN] = "kmalloc-";
+
+    for (i = 0; i < KMALLOC_NR_CLASSES; i++)
+    {
+        // 名字 kmalloc-<size>
+        size = kmalloc_class_size(i);
+        n = 0;
+        for (uint32 t = size; t; t /= 10)
+            n++;
+        name[8 + n] = '\0';
+        for (uint32 t = size; t; t /= 10)
+            name[8 + --n] = '0' + t % 10;
+        kmem_cache_create(&kmalloc_caches[i], name, size, 0, NULL);
+    }
 
     // 初始化专用缓存
-    kmem_cache_create(&task_struct_kmem_cache, "task_struct_kmem_cache", sizeof(struct task_struct), 0);
-    kmem_cache_create(&thread_info_kmem_cache, "thread_info_kmem_cache", 2 * PGSIZE, 0);
-    kmem_cache_create(&buf_kmem_cache, "buf_kmem_cache", sizeof(struct buf_head), 0);
-    kmem_cache_create(&bio_kmem_cache, "bio_kmem_cache", sizeof(struct bio), 0);
-    kmem_cache_create(&timer_kmem_cache, "timer_kmem_cache", sizeof(struct timer), 0);
-    kmem_cache_create(&efs_inode_kmem_cache, "inode_kmem_cache", sizeof(struct easy_m_inode), 0);
-    kmem_cache_create(&efs_dentry_kmem_cache, "dentry_kmem_cache", sizeof(struct easy_dentry), 0);
-    kmem_cache_create(&file_kmem_cache, "file_kmem_cache", sizeof(struct file), 0);
-    kmem_cache_create(&tf_kmem_cache, "tf_kmem_cache", sizeof(struct trapframe), 0);
-    kmem_cache_create(&vma_kmem_cache, "vma_kmem_cache", sizeof(struct vm_area_struct), 0);
+    kmem_cache_create(&task_struct_kmem_cache, "task_struct_kmem_cache", sizeof(struct task_struct), 0, NULL);
+    kmem_cache_create(&thread_info_kmem_cache, "thread_info_kmem_cache", 2 * PGSIZE, 0, NULL);
+    kmem_cache_create(&buf_kmem_cache, "buf_kmem_cache", sizeof(struct buf_head), __GFP_RECLAIMABLE, buf_ctor);
+    kmem_cache_create(&bio_kmem_cache, "bio_kmem_cache", sizeof(struct bio), 0, NULL);
+    kmem_cache_create(&timer_kmem_cache, "timer_kmem_cache", sizeof(struct timer), 0, NULL);
+    kmem_cache_create(&efs_inode_kmem_cache, "inode_kmem_cache", sizeof(struct easy_m_inode), __GFP_RECLAIMABLE, efs_i_ctor);
+    kmem_cache_create(&efs_dentry_kmem_cache, "dentry_kmem_cache", sizeof(struct easy_dentry), __GFP_RECLAIMABLE, efs_d_ctor);
+    kmem_cache_create(&file_kmem_cache, "file_kmem_cache", sizeof(struct file), 0, file_ctor);
+    kmem_cache_create(&tf_kmem_cache, "tf_kmem_cache", sizeof(struct trapframe), 0, NULL);
+    kmem_cache_create(&vma_kmem_cache, "vma_kmem_cache", sizeof(struct vm_area_struct), 0, NULL);
+}
+
+// 超过 KMALLOC_MAX_SIZE 的直接从伙伴系统分配整块页面
+// 头页打上 PG_large 并记下 order，kfree 据此还回去
+static void *kmalloc_large(int size, uint32 flags)
+{
+    int order = calculate_order(PGROUNDUP(size) / PGSIZE);
+    struct page *page;
+
+    if (order > MAX_LEVEL_INDEX)
+    {
+        printk("!!!kmalloc: size %d too large!!!\n", size);
+        return NULL;
+    }
+    page = alloc_pages(flags, order);
+    if (!page)
+        return NULL;
+    SetPageFlag(page, PG_large);
+    page->order = order;
+    return (void *)get_page_addr(page);
 }
 
 void *kmalloc(int size, uint32 flags)
 {
-    if (size < 1 || size > 8192)
+    if (size < 1)
     {
-        printk("!!!kmalloc: size illegal, must be between 1 and 8192!!!\n");
+        printk("!!!kmalloc: size illegal, must be positive!!!\n");
         return NULL;
     }
 
-    uint32 order = calculate_order((uint32)size) - 4;
     void *addr = NULL;
-    addr = kmem_cache_alloc(kmalloc_caches[order]);
+    if (size > KMALLOC_MAX_SIZE)
+        addr = kmalloc_large(size, flags);
+    else
+        addr = kmem_cache_alloc(&kmalloc_caches[kmalloc_index(size)]);
 
     if (!addr)
     {
@@ -89,9 +124,19 @@ void *kmalloc(int size, uint32 flags)
     return addr;
 }
 
+// 按页面的标志区分是 slab 中的对象还是直接分配的大块
 void kfree(void *obj)
 {
-    struct slab *slab;
-    slab = get_page_struct((uint64)obj)->slab;
-    kmem_cache_free(slab->kc, obj);
+    struct page *page = get_page_struct((uint64)obj);
+
+    if (TestPageFlag(page, PG_Slab))
+    {
+        kmem_cache_free(page->slab->kc, obj);
+        return;
+    }
+    if (!TestPageFlag(page, PG_large) || (uint64)obj != get_page_addr(page))
+        panic("kfree: %p was not allocated by kmalloc!\n", obj);
+
+    ClearPageFlag(page, PG_large);
+    free_pages(page, page->order);
 }
@@ -10,131 +10,595 @@
 #include "mm/kmalloc.h"
 #include "lib/string.h"
 #include "defs.h"
+#include "param.h"
+#include "lib/math.h"
+#include "core/proc.h"
 // 注：我们的伙伴算法，实际上只是管理 mem_map.pages 这个数组
 // 并不涉及具体页面地址的管理
 // 由于这个数组元素与页面地址一一对应的关系
 // 我们仅在分配/释放页面的出入口有所处理
 
+// free_lists[t][i] 中是迁移类型为 t 的 2^i 个页面的空闲块，只挂块的第一个页面（头页）
+// 头页带 PG_buddy 标志并记录 order，合并时据此准确判断伙伴是否是同样大小的空闲块
+// 空闲块挂在头页所在页面块的类型的链表中
+// nonempty[t] 的第 i 位表示 free_lists[t][i] 非空，找能满足的最小 order 只需要一次位运算
+// nr_free 是空闲链表中的页面总数，低于 BUDDY_LOW_PAGES 时回收 slab 中空闲的 slab
 struct
 {
     spinlock_t lock;
-    struct list_head free_lists[MAX_LEVEL];
+    struct list_head free_lists[MIGRATE_TYPES][MAX_LEVEL];
+    uint32 nonempty[MIGRATE_TYPES];
+    uint64 nr_free;
 } buddy;
 
+#define BUDDY_LOW_PAGES 1024
+
+// 每个页面块的迁移类型，需要持有 buddy 锁修改
+static uint8 pageblock_type[(ALL_PFN + PAGEBLOCK_NR - 1) / PAGEBLOCK_NR];
+
+// 自己类型的页面用完时，按顺序从别的类型借
+static const int fallbacks[MIGRATE_PCPTYPES][MIGRATE_PCPTYPES - 1] = {
+    [MIGRATE_UNMOVABLE] = {MIGRATE_RECLAIMABLE, MIGRATE_MOVABLE},
+    [MIGRATE_RECLAIMABLE] = {MIGRATE_UNMOVABLE, MIGRATE_MOVABLE},
+    [MIGRATE_MOVABLE] = {MIGRATE_RECLAIMABLE, MIGRATE_UNMOVABLE},
+};
+
+// 每个 CPU 的单页缓存，挡在伙伴系统的全局锁前面
+// 单页的分配释放只在本 CPU 的链表上进行（关中断即可，不用加锁），
+// 空了从伙伴系统批量取 PCP_BATCH 个，超过 PCP_HIGH 个就批量还回去 PCP_BATCH 个
+// 链表头部是刚释放的热页面（可能还在缓存里），分配从头部取，还给伙伴系统从尾部（冷的）取
+// 每种迁移类型一个链表，缓存不会把不同类型的页面混在一起
+#define PCP_HIGH 64
+#define PCP_BATCH 16
+
+static struct per_cpu_pages
+{
+    int count;
+    struct list_head lists[MIGRATE_PCPTYPES];
+} pcp[NCPU];
+
 // first address after kernel. defined by kernel.ld.
 // 由编译器最后计算出来，位于代码段和数据段的顶端
 // extern uint32 kernel_pfn_end;
 
+static inline int gfp_migratetype(uint32 flags)
+{
+    if (flags & __GFP_MOVABLE)
+        return MIGRATE_MOVABLE;
+    if (flags & __GFP_RECLAIMABLE)
+        return MIGRATE_RECLAIMABLE;
+    return MIGRATE_UNMOVABLE;
+}
+
+static inline uint64 page_pfn(const struct page *page)
+{
+    return page - mem_map.pages;
+}
+
+static inline int get_pageblock_type(const struct page *page)
+{
+    return pageblock_type[page_pfn(page) >> PAGEBLOCK_ORDER];
+}
+
+// 设置 page 开始的 2^order 个页面所在的页面块的类型
+// 需要持有 buddy 锁
+static void set_pageblock_type(struct page *page, const int order, const int type)
+{
+    uint64 pb = page_pfn(page) >> PAGEBLOCK_ORDER;
+    uint64 n = order > PAGEBLOCK_ORDER ? 1 << (order - PAGEBLOCK_ORDER) : 1;
+
+    while (n--)
+        pageblock_type[pb++] = type;
+}
+
+// 伙伴超出了内存页的范围返回 NULL
 static struct page *find_buddy(const struct page *page, const int order)
 {
     uint64 index = page - mem_map.pages;
     uint64 buddy_index = index ^ (1 << order);
     if (buddy_index >= ALL_PFN)
-    {
-        // 如果伙伴超出了内存页的范围，返回 NULL
-        printk("OOM ERROR!\n");
         return NULL;
-    }
     return mem_map.pages + buddy_index;
 }
 
-static struct page *buddy_alloc(const int order)
+// 需要持有 buddy 锁
+static inline void __add_to_free_list(struct page *page, const int order, const int type)
 {
-    if (order < 0 || order > MAX_LEVEL_INDEX)
-        return NULL;
+    SetPageFlag(page, PG_buddy);
+    page->order = order;
+    list_add_head(&page->buddy, &buddy.free_lists[type][order]);
+    buddy.nonempty[type] |= (1U << order);
+    buddy.nr_free += 1 << order;
+}
+
+// 需要持有 buddy 锁
+static inline void __del_from_free_list(struct page *page, const int order, const int type)
+{
+    list_del_init(&page->buddy);
+    ClearPageFlag(page, PG_buddy);
+    buddy.nr_free -= 1 << order;
+    if (list_empty(&buddy.free_lists[type][order]))
+        buddy.nonempty[type] &= ~(1U << order);
+}
+
+static inline void add_to_free_list(struct page *page, const int order)
+{
+    __add_to_free_list(page, order, get_pageblock_type(page));
+}
+
+static inline void del_from_free_list(struct page *page, const int order)
+{
+    __del_from_free_list(page, order, get_pageblock_type(page));
+}
+
+// 把一个页面块改成 type 类型，其中的空闲块一起挪到新类型的链表中
+// 需要持有 buddy 锁
+static void move_freepages_block(struct page *page, const int type)
+{
+    uint64 start = page_pfn(page) & ~(uint64)(PAGEBLOCK_NR - 1);
+    uint64 end = start + PAGEBLOCK_NR, i;
+    int old = get_pageblock_type(page);
+    struct page *p;
+
+    if (old == type)
+        return;
+    for (i = start; i < end && i < ALL_PFN;)
+    {
+        p = mem_map.pages + i;
+        if (TestPageFlag(p, PG_buddy) && p->order <= PAGEBLOCK_ORDER)
+        {
+            __del_from_free_list(p, p->order, old);
+            __add_to_free_list(p, p->order, type);
+            i += 1 << p->order;
+        }
+        else
+            i++;
+    }
+    set_pageblock_type(page, 0, type);
+}
 
-    int i, j;
+// 自己类型没有空闲块了，从别的类型借
+// 优先借最大的块：大块拆开后剩下的部分更可能整块归到新类型，而不是把别的类型的页面块打碎
+// 借的块够大（至少半个页面块）就把整个页面块改成自己的类型，以后同类分配都集中在这里
+// 需要持有 buddy 锁，返回的块还在链表中，order 通过 found 返回
+static struct page *steal_fallback(const int order, const int type, int *found)
+{
     struct page *page;
-    struct page *buddy_page;
+    int i, j, t;
 
-    spin_lock(&buddy.lock);
-    for (i = order; i < MAX_LEVEL; i++)
+    for (i = MAX_LEVEL_INDEX; i >= order; i--)
     {
-        // 找到有一个不为空的
-        if (!list_empty(&buddy.free_lists[i]))
+        for (j = 0; j < MIGRATE_PCPTYPES - 1; j++)
         {
-            // 弹出一个 page
-            page = list_entry(list_pop(&buddy.free_lists[i]), struct page, buddy);
-
-            // 拆分块直到满足所需 order
-            for (j = i; j > order; j--)
-            {
-                // 寻找下一级的伙伴(这里的伙伴存在的话一定是空闲的)
-                buddy_page = find_buddy(page, j - 1);
-                if (!buddy_page)
-                    break;
-
-                // 加到下一级的链表中
-                list_add_head(&buddy_page->buddy, &buddy.free_lists[j - 1]);
-            }
-            // 循环接受，该 page 也就是这个被拆分大块的起始地址（现在变成小块了）
-            spin_unlock(&buddy.lock);
+            t = fallbacks[type][j];
+            if (!(buddy.nonempty[t] & (1U << i)))
+                continue;
+            page = list_entry(list_first(&buddy.free_lists[t][i]), struct page, buddy);
+            if (i >= PAGEBLOCK_ORDER / 2 && i < PAGEBLOCK_ORDER)
+                move_freepages_block(page, type);
+            *found = i;
             return page;
         }
     }
-    // 没有找到
-    spin_unlock(&buddy.lock);
     return NULL;
 }
 
-static void buddy_free(struct page *pg, const int order)
+// 需要持有 buddy 锁
+static struct page *__buddy_alloc(const int order, const int type)
+{
+    uint32 mask = buddy.nonempty[type] & ~((1U << order) - 1);
+    struct page *page;
+    int i;
+
+    if (mask)
+    {
+        i = first_set_bit(mask);
+        page = list_entry(list_first(&buddy.free_lists[type][i]), struct page, buddy);
+    }
+    // 没有 >= order 的空闲块，去别的类型借
+    else if ((page = steal_fallback(order, type, &i)) == NULL)
+        return NULL;
+    del_from_free_list(page, i);
+    // 大于等于页面块的空闲块里都是整个的页面块，直接归到自己的类型
+    if (i >= PAGEBLOCK_ORDER)
+        set_pageblock_type(page, i, type);
+
+    // 拆分块直到满足所需 order，高地址的一半挂到下一级，低地址的一半继续拆
+    while (i > order)
+    {
+        i--;
+        add_to_free_list(page + (1 << i), i);
+    }
+    return page;
+}
+
+static struct page *buddy_alloc(const int order, const int type)
+{
+    struct page *page;
+
+    if (order < 0 || order > MAX_LEVEL_INDEX)
+        return NULL;
+    spin_lock(&buddy.lock);
+    page = __buddy_alloc(order, type);
+    spin_unlock(&buddy.lock);
+    return page;
+}
+
+// 需要持有 buddy 锁
+static void __buddy_free(struct page *pg, const int order)
 {
     int level;
     struct page *page = pg, *buddy_page;
 
-    spin_lock(&buddy.lock);
+    assert(!TestPageFlag(page, PG_buddy), "buddy_free: page %p double free\n", get_page_addr(page));
 
-    // 向上合并伙伴
+    // 向上合并伙伴：伙伴必须是同样 order 的空闲块的头页
     for (level = order; level < MAX_LEVEL_INDEX; level++)
     {
         buddy_page = find_buddy(page, level);
-        if (list_empty(&buddy.free_lists[level]))
+        if (buddy_page == NULL || !TestPageFlag(buddy_page, PG_buddy) || buddy_page->order != level)
             break;
-        // 伙伴不在，也就不用向上合并了
-        // 如果页面不空闲，则已经被分配出去了，现在一定不在伙伴系统里面
-        if (buddy_page == NULL || !is_page_free(buddy_page))
+        // 正在整理的页面块不和别的页面块合并，否则空闲页面会挂到别的类型上被分配出去
+        if (level >= PAGEBLOCK_ORDER &&
+            (get_pageblock_type(page) == MIGRATE_ISOLATE || get_pageblock_type(buddy_page) == MIGRATE_ISOLATE))
             break;
 
-        // 如果有伙伴块的话
-        list_del_init(&buddy_page->buddy);
-        list_del_init(&page->buddy);
-
+        del_from_free_list(buddy_page, level);
         // page 始终为位置更低的，这样最后的 page 就是最后大块的头儿
         page = page < buddy_page ? page : buddy_page;
     }
-    list_add_head(&page->buddy, &buddy.free_lists[level]);
+    add_to_free_list(page, level);
+}
+
+static void buddy_free(struct page *pg, const int order)
+{
+    spin_lock(&buddy.lock);
+    __buddy_free(pg, order);
+    spin_unlock(&buddy.lock);
+}
+
+// 从伙伴系统取一批单页放进本 CPU 缓存，只加一次锁
+// 需要关中断
+static void pcp_refill(struct per_cpu_pages *p, const int type)
+{
+    struct page *page;
+    int i;
+
+    spin_lock(&buddy.lock);
+    for (i = 0; i < PCP_BATCH; i++)
+    {
+        if ((page = __buddy_alloc(0, type)) == NULL)
+            break;
+        list_add_tail(&page->buddy, &p->lists[type]);
+        p->count++;
+    }
+    spin_unlock(&buddy.lock);
+}
+
+// 把本 CPU 缓存尾部（最冷）的 n 个页面还给伙伴系统，只加一次锁，各类型轮流还
+// 需要关中断
+static void pcp_drain(struct per_cpu_pages *p, int n)
+{
+    struct page *page;
+    int type = 0;
+
+    spin_lock(&buddy.lock);
+    while (n > 0 && p->count > 0)
+    {
+        type = (type + 1) % MIGRATE_PCPTYPES;
+        if (list_empty(&p->lists[type]))
+            continue;
+        page = list_entry(p->lists[type].prev, struct page, buddy);
+        list_del_init(&page->buddy);
+        p->count--;
+        n--;
+        __buddy_free(page, 0);
+    }
     spin_unlock(&buddy.lock);
 }
 
+static struct page *pcp_alloc(const int type)
+{
+    struct per_cpu_pages *p;
+    struct page *page = NULL;
+
+    push_off();
+    p = &pcp[cpuid()];
+    if (list_empty(&p->lists[type]))
+        pcp_refill(p, type);
+    if (!list_empty(&p->lists[type]))
+    {
+        page = list_entry(list_pop(&p->lists[type]), struct page, buddy);
+        p->count--;
+    }
+    pop_off();
+    return page;
+}
+
+static void pcp_free(struct page *page)
+{
+    struct per_cpu_pages *p;
+    int type = get_pageblock_type(page);
+
+    // 正在整理的页面块，直接还给伙伴系统才能合并
+    if (type == MIGRATE_ISOLATE)
+    {
+        buddy_free(page, 0);
+        return;
+    }
+    push_off();
+    p = &pcp[cpuid()];
+    list_add_head(&page->buddy, &p->lists[type]);
+    if (++p->count > PCP_HIGH)
+        pcp_drain(p, PCP_BATCH);
+    pop_off();
+}
+
 // 初始化 Buddy 系统
+// 把内核之后的所有页面按尽可能大的、按自身大小对齐的块挂进空闲链表
+// 开始时所有页面块都是可移动的，不可移动的分配会按需把页面块借走
 static void buddy_init()
 {
     uint64 i;
+    int order, t;
 
     // 初始化锁
     spin_init(&buddy.lock, "buddy");
 
     // 初始化伙伴的每个链表节点
-    for (i = 0; i < MAX_LEVEL; i++)
-        INIT_LIST_HEAD(&buddy.free_lists[i]);
+    for (t = 0; t < MIGRATE_TYPES; t++)
+    {
+        for (i = 0; i < MAX_LEVEL; i++)
+            INIT_LIST_HEAD(&buddy.free_lists[t][i]);
+        buddy.nonempty[t] = 0;
+    }
+    for (i = 0; i < sizeof(pageblock_type); i++)
+        pageblock_type[i] = MIGRATE_MOVABLE;
+
+    for (i = 0; i < NCPU; i++)
+    {
+        pcp[i].count = 0;
+        for (t = 0; t < MIGRATE_PCPTYPES; t++)
+            INIT_LIST_HEAD(&pcp[i].lists[t]);
+    }
 
-    for (i = kernel_pfn_end + 1; i < ALL_PFN; i += MAX_LEVEL_COUNT)
-        list_add_head(&mem_map.pages[i].buddy, &buddy.free_lists[MAX_LEVEL_INDEX]);
+    // end 没有按页对齐，kernel_pfn_end 这一页还有内核的数据，从下一页开始
+    for (i = kernel_pfn_end + 1; i < ALL_PFN; i += (1 << order))
+    {
+        order = MAX_LEVEL_INDEX;
+        while (order > 0 && ((i & ((1 << order) - 1)) || i + (1 << order) > ALL_PFN))
+            order--;
+        add_to_free_list(&mem_map.pages[i], order);
+    }
+    __sync_synchronize();
+    // printk("Buddy system: %d blocks\n",ALL_PFN - kernel_pfn_end);
+}
 
-    // 处理最后一点不足 max_level_count 的
-    list_pop(&buddy.free_lists[MAX_LEVEL_INDEX]);
+// 打印每一级空闲块的个数
+void buddy_info()
+{
+    static const char *type_name[MIGRATE_TYPES] = {"unmovable", "reclaimable", "movable", "isolate"};
+    int i, t;
 
-    uint end_free_count = (ALL_PFN - kernel_pfn_end) % MAX_LEVEL_COUNT;
-    // 假装分配
-    for (i = ALL_PFN - end_free_count; i < ALL_PFN; i++)
-        page_push(&mem_map.pages[i]);
+    spin_lock(&buddy.lock);
+    for (t = 0; t < MIGRATE_TYPES; t++)
+    {
+        printk("%s:", type_name[t]);
+        for (i = 0; i < MAX_LEVEL; i++)
+            printk(" { L: %d, N: %d }", i, list_len(&buddy.free_lists[t][i]));
+        printk("\n");
+    }
+    spin_unlock(&buddy.lock);
+}
 
-    __sync_synchronize();
-    // 一个一个回收
-    for (i = ALL_PFN - end_free_count; i < ALL_PFN; i++)
-        free_page(mem_map.pages + i);
+// 是否有 >= order 的空闲块（正在整理的不算）
+// 需要持有 buddy 锁
+static int has_free_block(const int order)
+{
+    uint32 mask = ~((1U << order) - 1);
+    int t;
 
-    // printk("Buddy system: %d blocks\n",ALL_PFN - kernel_pfn_end);
+    for (t = 0; t < MIGRATE_PCPTYPES; t++)
+        if (buddy.nonempty[t] & mask)
+            return 1;
+    return 0;
+}
+
+// 页面块中被分配出去的页面是否都可以搬走
+// 有空闲块的地方直接跳过，其余页面必须是登记了搬迁函数、只有一个引用的
+// 需要持有 buddy 锁
+static int pageblock_evacuable(uint64 start)
+{
+    struct page *p;
+    uint64 i;
+    int used = 0;
+
+    for (i = start; i < start + PAGEBLOCK_NR && i < ALL_PFN;)
+    {
+        p = mem_map.pages + i;
+        if (TestPageFlag(p, PG_buddy))
+        {
+            i += 1 << p->order;
+            continue;
+        }
+        if (page_count(p) != PG_FREE)
+        {
+            if (!p->migrate || page_count(p) != 0)
+                return 0;
+            used++;
+        }
+        i++;
+    }
+    return used;
+}
+
+// 把一个可移动的页面搬到页面块之外
+// 新页面从可移动类型的空闲链表中取，正在整理的页面块的空闲页面在 ISOLATE 链表中，不会被取到
+static int migrate_one(struct page *page)
+{
+    struct page *newpage = buddy_alloc(0, MIGRATE_MOVABLE);
+
+    if (!newpage)
+        return -1;
+    page_push(newpage);
+    if (page->migrate(page, newpage) < 0)
+    {
+        page_pop(newpage);
+        newpage->migrate = NULL;
+        buddy_free(newpage, 0);
+        return -1;
+    }
+    // 旧页面已经没有人引用了
+    page->migrate = NULL;
+    if (page_pop_test(page))
+        buddy_free(page, 0);
+    return 0;
+}
+
+// 结束整理，恢复成可移动的页面块
+// 如果整个页面块都空出来了，重新走一遍合并，与相邻的页面块拼成更大的块
+// 需要持有 buddy 锁
+static void undo_isolate(struct page *start)
+{
+    if (TestPageFlag(start, PG_buddy) && start->order == PAGEBLOCK_ORDER)
+    {
+        __del_from_free_list(start, PAGEBLOCK_ORDER, MIGRATE_ISOLATE);
+        set_pageblock_type(start, 0, MIGRATE_MOVABLE);
+        __buddy_free(start, PAGEBLOCK_ORDER);
+    }
+    else
+        move_freepages_block(start, MIGRATE_MOVABLE);
+}
+
+// 内存整理：把可移动页面块中的页面搬走，腾出 >= order 的连续空闲块
+// 从高地址的页面块开始整理，搬迁的目标页面倾向于低地址（大块拆分时低地址的一半先用），
+// 只整理所有已分配页面都能搬走的页面块
+// 不能在持有可移动页面所有者的锁时调用（搬迁函数拿不到锁会失败，不会死锁）
+// 返回是否已经有了 >= order 的空闲块
+int compact_memory(int order)
+{
+    struct page *p;
+    uint64 pb, i;
+    int done;
+
+    if (order > MAX_LEVEL_INDEX)
+        return 0;
+
+    // 本 CPU 缓存里的页面也是空闲的，先还回去才能合并
+    push_off();
+    pcp_drain(&pcp[cpuid()], PCP_HIGH + 1);
+    pop_off();
+
+    for (pb = (ALL_PFN - 1) >> PAGEBLOCK_ORDER; pb > (kernel_pfn_end >> PAGEBLOCK_ORDER); pb--)
+    {
+        spin_lock(&buddy.lock);
+        done = has_free_block(order);
+        if (done || pageblock_type[pb] != MIGRATE_MOVABLE || pageblock_evacuable(pb << PAGEBLOCK_ORDER) == 0)
+        {
+            spin_unlock(&buddy.lock);
+            if (done)
+                return 1;
+            continue;
+        }
+        move_freepages_block(mem_map.pages + (pb << PAGEBLOCK_ORDER), MIGRATE_ISOLATE);
+        spin_unlock(&buddy.lock);
+
+        // 搬迁函数要拿所有者的锁，不能持有 buddy 锁
+        for (i = pb << PAGEBLOCK_ORDER; i < ((pb + 1) << PAGEBLOCK_ORDER) && i < ALL_PFN; i++)
+        {
+            p = mem_map.pages + i;
+            if (!TestPageFlag(p, PG_buddy) && page_count(p) == 0 && p->migrate)
+                migrate_one(p);
+        }
+
+        spin_lock(&buddy.lock);
+        undo_isolate(mem_map.pages + (pb << PAGEBLOCK_ORDER));
+        spin_unlock(&buddy.lock);
+    }
+
+    spin_lock(&buddy.lock);
+    done = has_free_block(order);
+    spin_unlock(&buddy.lock);
+    return done;
+}
+
+// 预先清零的页面池
+// 空闲的 CPU 在调度器中 wfi 之前把清零好的页面放进来，__GFP_ZERO 的单页分配直接从这里取，
+// 页表等需要清零的页面不用在缺页、建页表的路径上 memset
+// 池中的页面是已分配的（引用为 0），用 buddy 链表节点串起来
+#define ZERO_POOL_HIGH 64
+
+static struct
+{
+    spinlock_t lock;
+    struct list_head pages;
+    int count;
+} zero_pool;
+
+static struct page *zero_pool_get()
+{
+    struct page *page = NULL;
+
+    spin_lock(&zero_pool.lock);
+    if (zero_pool.count > 0)
+    {
+        page = list_entry(list_pop(&zero_pool.pages), struct page, buddy);
+        INIT_LIST_HEAD(&page->buddy);
+        zero_pool.count--;
+    }
+    spin_unlock(&zero_pool.lock);
+    return page;
+}
+
+// 空闲时补充页面池，最多补 n 个，返回补了几个
+// 内存紧张时不补，免得和真正的分配抢页面
+int zero_pool_refill(int n)
+{
+    struct page *page;
+    int filled = 0;
+
+    while (filled < n && zero_pool.count < ZERO_POOL_HIGH && buddy.nr_free >= BUDDY_LOW_PAGES)
+    {
+        page = pcp_alloc(MIGRATE_UNMOVABLE);
+        if (!page)
+            break;
+        page_push(page);
+        memset((void *)get_page_addr(page), 0, PGSIZE);
+
+        spin_lock(&zero_pool.lock);
+        list_add_head(&page->buddy, &zero_pool.pages);
+        zero_pool.count++;
+        spin_unlock(&zero_pool.lock);
+        filled++;
+    }
+    return filled;
+}
+
+// 把池中的页面全部还给伙伴系统，返回页面数
+static int zero_pool_drain()
+{
+    struct list_head head;
+    struct page *page, *tmp;
+    int n;
+
+    INIT_LIST_HEAD(&head);
+    spin_lock(&zero_pool.lock);
+    list_for_each_entry_safe(page, tmp, &zero_pool.pages, buddy)
+    {
+        list_del(&page->buddy);
+        list_add_head(&page->buddy, &head);
+    }
+    n = zero_pool.count;
+    zero_pool.count = 0;
+    spin_unlock(&zero_pool.lock);
+
+    list_for_each_entry_safe(page, tmp, &head, buddy)
+    {
+        list_del_init(&page->buddy);
+        if (page_pop_test(page))
+            buddy_free(page, 0);
+    }
+    return n;
 }
 
 // 内存管理初始化: page、buddy、kmem_cache、kmalloc
@@ -142,14 +606,52 @@ void mem_init()
 {
     all_page_init();
     buddy_init();
+    spin_init(&zero_pool.lock, "zero_pool");
+    INIT_LIST_HEAD(&zero_pool.pages);
     kmem_cache_init();
     kmalloc_init();
 }
 
+// 回收空闲的 slab 和清零页面池，返回回收的页面数
+static int reclaim_pages()
+{
+    return kmem_cache_shrink_all() + zero_pool_drain();
+}
+
+// 是否已经低于水位
+static int below_low_pages;
+
+// 空闲页面刚跌破水位时回收一次，之后一直低于水位的分配不再回收（回收要扫描所有 cache），
+// 回到水位以上后再重新开始；真的分配不到时 alloc_pages 还会再回收
+// 不加锁读 nr_free，只是个大概的判断
+static void check_low_memory()
+{
+    if (buddy.nr_free >= BUDDY_LOW_PAGES)
+    {
+        if (below_low_pages)
+            below_low_pages = 0;
+        return;
+    }
+    if (!below_low_pages && __sync_lock_test_and_set(&below_low_pages, 1) == 0)
+        reclaim_pages();
+}
+
 // 分配 pages
+// 失败时先回收空闲的 slab 和清零页面池再试，大块分配还会整理一次内存再试
 struct page *alloc_pages(uint32 flags, const int order)
 {
-    struct page *pages = buddy_alloc(order);
+    struct page *pages;
+
+    if (order == 0)
+        return alloc_page(flags);
+    pages = buddy_alloc(order, gfp_migratetype(flags));
+    if (!pages && reclaim_pages())
+        pages = buddy_alloc(order, gfp_migratetype(flags));
+    if (!pages && compact_memory(order))
+        pages = buddy_alloc(order, gfp_migratetype(flags));
+    if (!pages)
+        return NULL;
+    check_low_memory();
     // 只需要设置第一个页面的引用
     page_push(pages);
 
@@ -158,31 +660,63 @@ struct page *alloc_pages(uint32 flags, const int order)
 
 void *__alloc_pages(uint32 flags, const int order)
 {
-    return (void *)get_page_addr(alloc_pages(flags, order));
+    struct page *pages = alloc_pages(flags, order);
+    void *addr;
+
+    if (!pages)
+        return NULL;
+    addr = (void *)get_page_addr(pages);
+    if (flags & __GFP_ZERO)
+        memset(addr, 0, PGSIZE << order);
+    return addr;
 }
 
-// 分配一个 page
+// 分配一个 page，走本 CPU 的缓存
 struct page *alloc_page(uint32 flags)
 {
-    struct page *page = buddy_alloc(0);
+    struct page *page = pcp_alloc(gfp_migratetype(flags));
+    if (!page && reclaim_pages())
+        page = pcp_alloc(gfp_migratetype(flags));
+    if (!page)
+        return NULL;
     page_push(page);
+    check_low_memory();
 
     return page;
 }
 
+// 只有 __GFP_ZERO 才清零，不可移动的先从清零页面池取
 void *__alloc_page(uint32 flags)
 {
-    void *addr = (void *)get_page_addr(alloc_page(flags));
-    memset(addr, 0, PGSIZE);
+    struct page *page;
+    void *addr;
+
+    if ((flags & __GFP_ZERO) && gfp_migratetype(flags) == MIGRATE_UNMOVABLE && (page = zero_pool_get()))
+        return (void *)get_page_addr(page);
+
+    page = alloc_page(flags);
+    if (!page)
+        return NULL;
+    addr = (void *)get_page_addr(page);
+    if (flags & __GFP_ZERO)
+        memset(addr, 0, PGSIZE);
     return addr;
 }
 
 // 释放 pages
 void free_pages(struct page *pages, const int order)
 {
+    if (order == 0)
+    {
+        free_page(pages);
+        return;
+    }
     // 只需要设置第一个页面的引用
     if (page_pop_test(pages))
+    {
+        pages->migrate = NULL;
         buddy_free(pages, order);
+    }
 }
 
 void __free_pages(void *addr, const int order)
@@ -190,12 +724,14 @@ void __free_pages(void *addr, const int order)
     free_pages(get_page_struct((uint64)addr), order);
 }
 
-// 释放一个 page
+// 释放一个 page，先放回本 CPU 的缓存
 void free_page(struct page *page)
 {
-    // 只需要设置第一个页面的引用
     if (page_pop_test(page))
-        buddy_free(page, 0);
+    {
+        page->migrate = NULL;
+        pcp_free(page);
+    }
 }
 
 void __free_page(void *addr)
@@ -35,8 +35,10 @@ void page_init(struct page *pg,uint32 flags)
 {
     pg->flags = flags;
     atomic_set(&pg->count,PG_FREE);
+    pg->order = 0;
     INIT_LIST_HEAD(&pg->buddy);
     pg->slab = NULL;
+    pg->migrate = NULL;
 }
 
 // 首次初始化
@@ -6,52 +6,82 @@
 #include "lib/math.h"
 #include "param.h"
 #include "core/proc.h"
+#include "lib/atomic.h"
 
 struct list_head kmem_cache_list;
+static spinlock_t kmem_cache_list_lock;
+
+// 所有缓存中空闲 slab 的总数，没有的话回收时不用挨个去看
+static atomic_t nr_free_slabs = ATOMIC_INIT(0);
+
+// 空闲对象中存放 next 指针的位置
+// 没有构造函数时在对象开头；有的话在对象后面，不会破坏构造好的内容
+#define obj_next(cache, obj) (*(void **)((char *)(obj) + (cache)->offset))
 
 // 初始化 Slab 分配器
 void kmem_cache_init()
 {
     INIT_LIST_HEAD(&kmem_cache_list);
+    spin_init(&kmem_cache_list_lock, "kmem_cache_list");
+}
+
+// 对象的对齐：取对象大小最低的一位，在 8 到 SLAB_MAX_ALIGN 之间
+static uint16 slab_obj_align(uint16 size)
+{
+    uint16 align = size & -size;
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+    if (align > SLAB_MAX_ALIGN)
+        align = SLAB_MAX_ALIGN;
+    return align;
+}
+
+// 第一个对象在 slab 页面中的偏移：跳过开头的 struct slab，按对象对齐
+static uint16 slab_obj_offset(uint16 size)
+{
+    uint16 align = slab_obj_align(size);
+    return (sizeof(struct slab) + align - 1) & ~(align - 1);
 }
 
 // 由 kmem_cache 信息创建一个 slab 节点（未插入 kmem_cache.slabs 链表）
+// struct slab 放在 slab 页面的开头，后面紧跟着对象
+// 空闲对象的 next 指针存放在对象自己里面，有构造函数的话对所有对象构造一次
 // 注：kmem_cache.size 需要已经对齐
 static struct slab *slab_create(struct kmem_cache *cache)
 {
     int i, page_count;
     struct slab *slab;
     struct page *page;
+    char *obj;
 
-    slab = (struct slab *)__alloc_page(cache->flags);
+    slab = (struct slab *)__alloc_pages(cache->flags, cache->order);
     if (!slab)
         return NULL;
-    slab->objs = __alloc_pages(cache->flags, cache->order);
-    if (!slab->objs)
-    {
-        // 释放已分配的 slab
-        __free_page((void *)slab);
-        return NULL;
-    }
 
     // 修改页面标志
-    page = get_page_struct((uint64)(slab->objs));
+    page = get_page_struct((uint64)slab);
     page_count = 1 << cache->order;
     for (i = 0; i < page_count; i++)
     {
         SetPageFlag(page + i, PG_Slab);
-        page->slab = slab;
+        (page + i)->slab = slab;
     }
 
     slab->kc = cache;
+    slab->remote_free = SLAB_UNFROZEN;
     slab->inuse = 0;
-    slab->free_list = &(slab->free_list);
+    slab->objs = (char *)slab + slab_obj_offset(cache->size);
     INIT_LIST_HEAD(&slab->list);
-    for (uint i = 0; i < cache->count_per_slab; i++)
+
+    // 把所有对象串成空闲链表
+    obj = slab->objs;
+    for (i = 0; i < cache->count_per_slab; i++, obj += cache->size)
     {
-        *((uint64 *)slab->free_list + i + 1) = (uint64)((char *)slab->objs + i * cache->size);
+        if (cache->ctor)
+            cache->ctor(obj);
+        obj_next(cache, obj) = i < cache->count_per_slab - 1 ? obj + cache->size : NULL;
     }
-    slab->free_list = (uint64 *)slab->free_list + 1;
+    slab->free_list = slab->objs;
     return slab;
 }
 
@@ -61,55 +91,61 @@ static void slab_destory(struct slab *slab)
     struct page *page;
 
     // 恢复页面
-    page = get_page_struct((uint64)(slab->objs));
+    page = get_page_struct((uint64)slab);
     page_count = 1 << slab->kc->order;
     for (i = 0; i < page_count; i++)
     {
-        SetPageFlag(page + i, 0);
-        page->slab = NULL;
+        ClearPageFlag(page + i, PG_Slab);
+        (page + i)->slab = NULL;
     }
 
-    // 释放页面
-    __free_pages((void *)slab->objs, slab->kc->order);
-    __free_page((void *)slab);
+    // 释放页面，struct slab 也一起释放了
+    __free_pages((void *)slab, slab->kc->order);
+}
+
+// slab 中能放下的对象个数，开头的 struct slab 也要算进去
+static uint16 calc_obj_count(uint16 obj_size, uint8 order)
+{
+    return ((1 << order) * PGSIZE - slab_obj_offset(obj_size)) / obj_size;
 }
 
 // 计算满足最少容纳 MIN_OBJ_COUNT_PER_PAGE 个对象的order
+// 对象大小不再是 2 的幂，尾巴上剩下的空间超过 slab 的 1/8 时，
+// 在不超过 SLAB_MAX_ORDER 的前提下加大 order 让对象排得更紧
 static uint8 calc_slab_order(uint16 obj_size)
 {
-    // 确保每个 slab 至少容纳 MIN_OBJ_COUNT_PER_PAGE 个对象
-    uint32 require_size = obj_size * MIN_OBJ_COUNT_PER_PAGE;
-
     uint8 order = 0;
-    uint32 slab_size = PGSIZE;
+    uint32 slab_size, waste;
 
-    while (require_size > slab_size)
-    {
+    // 确保每个 slab 至少容纳 MIN_OBJ_COUNT_PER_PAGE 个对象
+    while (calc_obj_count(obj_size, order) < MIN_OBJ_COUNT_PER_PAGE)
         order++;
-        slab_size <<= 1;
-    }
 
+    for (; order < SLAB_MAX_ORDER; order++)
+    {
+        slab_size = (1 << order) * PGSIZE;
+        waste = slab_size - calc_obj_count(obj_size, order) * obj_size;
+        if (waste * 8 <= slab_size)
+            break;
+    }
     return order;
 }
 
 // 弹出一个空闲的地址（申请地址）
 static void *obj_pop(struct slab *slab)
 {
+    void *obj = slab->free_list;
     slab->inuse++;
-    void *tmp = (void *)(*(uint64 *)(slab->free_list));
-    // 指针上移
-    slab->free_list = (uint64 *)slab->free_list + 1;
-
-    return tmp;
+    slab->free_list = obj_next(slab->kc, obj);
+    return obj;
 }
 
 // 插入一个空闲的地址（释放地址）
 static void obj_push(struct slab *slab, void *obj)
 {
     slab->inuse--;
-    // 指针下移
-    slab->free_list = (uint64 *)slab->free_list - 1;
-    *(void **)slab->free_list = obj;
+    obj_next(slab->kc, obj) = slab->free_list;
+    slab->free_list = obj;
 }
 
 // slab 是不是未满，还有空
@@ -118,47 +154,175 @@ static int is_slab_partial(struct slab *slab, struct kmem_cache *cache)
     return slab->inuse < cache->count_per_slab;
 }
 
-// 初始化每个 kmem_cache 缓存的 cache_cpu 部分
-// 注：kmem_cache.size 需要已经对齐
-static void cache_cpu_init(struct kmem_cache *cache)
+// 取走别的 CPU 释放到活动 slab 上的对象，放回本地的空闲栈，返回取回的个数
+// unfreeze 为 1 时同时解冻，之后的远程释放会走加锁的路径
+// 只能由冻结这个 slab 的 CPU 调用
+static int slab_drain_remote(struct slab *slab, int unfreeze)
 {
-    uint16 i;
-    struct slab *cpu_slab;
-    for (i = 0; i < NCPU; i++)
+    void *obj, *tail;
+    int n;
+
+    obj = __sync_lock_test_and_set(&slab->remote_free, unfreeze ? SLAB_UNFROZEN : NULL);
+    __sync_synchronize();
+    if (!obj)
+        return 0;
+
+    // 远程链表和本地空闲链表用的是同一个 next 指针，找到尾巴整条接上即可
+    for (n = 1, tail = obj; obj_next(slab->kc, tail); tail = obj_next(slab->kc, tail))
+        n++;
+    obj_next(slab->kc, tail) = slab->free_list;
+    slab->free_list = obj;
+    slab->inuse -= n;
+    return n;
+}
+
+// 释放到被别的 CPU 冻结的活动 slab：无锁压进 remote_free
+// slab 没有被冻结返回 0
+static int slab_free_remote(struct slab *slab, void *obj)
+{
+    void *old;
+
+    do
     {
-        cpu_slab = slab_create(cache);
-        if (!cpu_slab)
-            panic("slab.c: cache_cpu_init Faild!\n");
-        cache->cache_cpu[i] = cpu_slab;
+        old = slab->remote_free;
+        if (old == SLAB_UNFROZEN)
+            return 0;
+        obj_next(slab->kc, obj) = old;
+    } while (!__sync_bool_compare_and_swap(&slab->remote_free, old, obj));
+    return 1;
+}
+
+// 把不在任何链表上的 slab 按使用情况放到 free/part/full 链表上
+// 空闲的 slab 已经有 SLAB_FREE_HIGH 个了就不再留着，返回给调用者，放锁后再释放
+// 需要持有 kmem_cache 的锁
+static struct slab *slab_place(struct kmem_cache *cache, struct slab *slab)
+{
+    if (slab->inuse == 0)
+    {
+        if (cache->nr_free_slabs >= SLAB_FREE_HIGH)
+            return slab;
+        list_add_head(&slab->list, &cache->free_slabs);
+        cache->nr_free_slabs++;
+        atomic_inc(&nr_free_slabs);
     }
+    else if (is_slab_partial(slab, cache))
+        list_add_head(&slab->list, &cache->part_slabs);
+    else
+        list_add_head(&slab->list, &cache->full_slabs);
+    return NULL;
 }
 
-// 增加 slab
-static struct slab *kmem_cache_add_slab(struct kmem_cache *cache)
+// 把空闲的 slab 全部摘到 head 上，返回个数
+// 需要持有 kmem_cache 的锁
+static int take_free_slabs(struct kmem_cache *cache, struct list_head *head)
 {
-    struct slab *new_slab = slab_create(cache);
-    list_add_head(&new_slab->list, &cache->part_slabs);
-    return new_slab;
+    struct slab *slab, *tmp;
+    int n = cache->nr_free_slabs;
+
+    list_for_each_entry_safe(slab, tmp, &cache->free_slabs, list)
+    {
+        list_del(&slab->list);
+        list_add_head(&slab->list, head);
+    }
+    cache->nr_free_slabs = 0;
+    atomic_sub(n, &nr_free_slabs);
+    return n;
+}
+
+// 释放 head 上所有的 slab，返回还给伙伴系统的页面数
+static int destory_slab_list(struct list_head *head)
+{
+    struct slab *slab, *tmp;
+    int pages = 0;
+
+    list_for_each_entry_safe(slab, tmp, head, list)
+    {
+        pages += 1 << slab->kc->order;
+        slab_destory(slab);
+    }
+    return pages;
+}
+
+// 本 CPU 的活动 slab 用完了：解冻放回链表，换一个 slab 冻结为活动 slab
+// 依次从部分空闲的、空闲的 slab 中取，都没有就新建一个
+// 需要关中断
+static struct slab *cache_cpu_refill(struct kmem_cache *cache, struct slab *old)
+{
+    struct slab *slab, *victim = NULL;
+
+    spin_lock(&cache->lock);
+    if (old)
+    {
+        // 解冻的同时可能又有远程释放进来，一起取回
+        slab_drain_remote(old, 1);
+        victim = slab_place(cache, old);
+    }
+
+    if (!list_empty(&cache->part_slabs))
+    {
+        slab = list_entry(list_first(&cache->part_slabs), struct slab, list);
+        list_del_init(&slab->list);
+    }
+    else if (!list_empty(&cache->free_slabs))
+    {
+        slab = list_entry(list_first(&cache->free_slabs), struct slab, list);
+        list_del_init(&slab->list);
+        cache->nr_free_slabs--;
+        atomic_dec(&nr_free_slabs);
+    }
+    else if ((slab = slab_create(cache)) == NULL)
+    {
+        cache->cache_cpu[cpuid()] = NULL;
+        spin_unlock(&cache->lock);
+        if (victim)
+            slab_destory(victim);
+        return NULL;
+    }
+    slab->remote_free = NULL;
+    cache->cache_cpu[cpuid()] = slab;
+    spin_unlock(&cache->lock);
+    if (victim)
+        slab_destory(victim);
+    return slab;
 }
 
 // 初始化缓存池
-void kmem_cache_create(struct kmem_cache *cache, const char *name, uint16 size, uint32 flags)
+// ctor 不为空时，在 slab 新建时对每个对象调用一次；
+// 调用者释放对象时要保证它回到构造好的状态（锁已释放、链表为空等），申请到的对象就不用再初始化这些了
+void kmem_cache_create(struct kmem_cache *cache, const char *name, uint16 size, uint32 flags, void (*ctor)(void *))
 {
+    int i;
+
     spin_init(&cache->lock,"slab");
     spin_lock(&cache->lock);
 
     strncpy(cache->name, name, CACHE_MAX_NAME_LEN);
     cache->flags = flags;
-    cache->size = (uint16)next_power_of_2(size); // 对齐
-    cache->order = calc_slab_order(size);
-    cache->count_per_slab = (1 << cache->order) * PGSIZE / cache->size;
+    cache->ctor = ctor;
+    // 按指针大小对齐即可，不再向上取 2 的幂，空闲时对象里要放 next 指针
+    cache->size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    cache->offset = 0;
+    if (ctor)
+    {
+        // 构造好的内容不能被 next 指针覆盖，单独放在对象后面
+        cache->offset = cache->size;
+        cache->size += sizeof(void *);
+    }
+    cache->order = calc_slab_order(cache->size);
+    cache->count_per_slab = calc_obj_count(cache->size, cache->order);
     INIT_LIST_HEAD(&cache->part_slabs);
     INIT_LIST_HEAD(&cache->full_slabs);
+    INIT_LIST_HEAD(&cache->free_slabs);
+    cache->nr_free_slabs = 0;
     INIT_LIST_HEAD(&cache->list);
-    cache_cpu_init(cache);
+    // 每个 CPU 的活动 slab 等第一次在这个 CPU 上申请时再建
+    for (i = 0; i < NCPU; i++)
+        cache->cache_cpu[i] = NULL;
+    spin_unlock(&cache->lock);
 
+    spin_lock(&kmem_cache_list_lock);
     list_add_head(&cache->list, &kmem_cache_list);
-    spin_unlock(&cache->lock);
+    spin_unlock(&kmem_cache_list_lock);
 }
 
 // 这里暂时还有一点问题
@@ -171,11 +335,16 @@ void kmem_cache_destory(struct kmem_cache *cache)
     int i;
     struct slab *slab, *tmp;
 
+    spin_lock(&kmem_cache_list_lock);
     spin_lock(&cache->lock);
     // 销毁 cpu_cache
     for (i = 0; i < NCPU; i++)
-        slab_destory(cache->cache_cpu[i]);
-    
+    {
+        if (cache->cache_cpu[i])
+            slab_destory(cache->cache_cpu[i]);
+        cache->cache_cpu[i] = NULL;
+    }
+
     // 销毁slabs
     list_for_each_entry_safe(slab, tmp, &cache->part_slabs, list)
     {
@@ -185,12 +354,20 @@ void kmem_cache_destory(struct kmem_cache *cache)
     {
         slab_destory(slab);
     }
+    list_for_each_entry_safe(slab, tmp, &cache->free_slabs, list)
+    {
+        slab_destory(slab);
+    }
+    atomic_sub(cache->nr_free_slabs, &nr_free_slabs);
+    cache->nr_free_slabs = 0;
     list_del_init(&cache->list);
     spin_unlock(&cache->lock);
+    spin_unlock(&kmem_cache_list_lock);
     printk("destory kmem_cache: '%s' ok!\n", cache->name);
 }
 
 // 申请对象
+// 一般情况下只在本 CPU 的活动 slab 上操作，不加锁
 void *kmem_cache_alloc(struct kmem_cache *cache)
 {
     if (!cache)
@@ -199,48 +376,32 @@ void *kmem_cache_alloc(struct kmem_cache *cache)
     if (list_empty(&cache->list))
         panic("kmem_cache_alloc: '%s' has already been freed!\n", cache->name);
 
-    int _cpuid;
     struct slab *slab;
-    struct slab *cpu_slab;
     void *addr;
 
-    _cpuid = cpuid();
-    cpu_slab = cache->cache_cpu[_cpuid];
+    // 关中断，防止中途被调度到别的 CPU 上
+    push_off();
+    slab = cache->cache_cpu[cpuid()];
 
-    // 如果当前还有可用的，直接弹出即可
-    if (is_slab_partial(cpu_slab, cache))
+    // 还没有活动 slab（第一次在这个 CPU 上申请），或者活动 slab 用完了，
+    // 用完的先看看别的 CPU 有没有还回来的，没有再换一个
+    if (!slab || (!is_slab_partial(slab, cache) && slab_drain_remote(slab, 0) == 0))
     {
-        return obj_pop(cpu_slab);
+        slab = cache_cpu_refill(cache, slab);
+        if (!slab)
+        {
+            pop_off();
+            return NULL;
+        }
     }
-
-    // 如果 cpu_cache 可用的已经分配完了
-    // 则从 part_slabs 链中查找
-    spin_lock(&cache->lock);
-    // 如果 part_slabs 为空，则说明现在已经没有空闲的slab可用了，于是新添一个
-    // 新添的这个第一次分配一定还有剩余的，弹出一个地址返回即可
-    if (list_empty(&cache->part_slabs))
-    {
-        slab = kmem_cache_add_slab(cache);
-        addr = obj_pop(slab);
-        spin_unlock(&cache->lock);
-        return addr;
-    }
-
-    // 一般情况下，从当前的 part_slabs 中查找
-    // 当前的还有可用，这里需要看是不是分出去后就没有了
-    slab = list_entry(list_first(&cache->part_slabs), struct slab, list);
     addr = obj_pop(slab);
-    if (!is_slab_partial(slab, cache))
-    {
-        list_del(&slab->list);
-        list_add_head(&slab->list, &cache->full_slabs);
-    }
-
-    spin_unlock(&cache->lock);
+    pop_off();
     return addr;
 }
 
 // 释放对象
+// 本 CPU 的活动 slab 直接放回；别的 CPU 的活动 slab 无锁地挂到它的 remote_free 上；
+// 都不是的话加锁放回，满的 slab 变成部分空闲的
 void kmem_cache_free(struct kmem_cache *cache, void *obj)
 {
     if (!cache)
@@ -252,25 +413,66 @@ void kmem_cache_free(struct kmem_cache *cache, void *obj)
     struct slab *slab;
     slab = get_page_struct((uint64)obj)->slab;
 
-    // 如果链表为空，说明是 cpu_cache,直接释放即可
-    // 如果是 cpu_cache,则其他cpu无法访问这个slab的，是安全的，不必加锁
-    if (list_empty(&slab->list))
+    push_off();
+    if (slab == cache->cache_cpu[cpuid()])
     {
         obj_push(slab, obj);
+        pop_off();
         return;
     }
+    pop_off();
 
-    // 否则就是普通的
-    spin_lock(&cache->lock);
+    if (slab_free_remote(slab, obj))
+        return;
+
+    struct slab *victim = NULL;
 
-    // 如果原先全部都分配出去了，要 full 里提取出来放到 part 上
-    if (!is_slab_partial(slab, cache))
+    spin_lock(&cache->lock);
+    // 冻结和解冻都在锁内进行，加锁后再看一次：这期间可能被某个 CPU 拿去做了活动 slab
+    if (!slab_free_remote(slab, obj))
     {
-        list_del(&slab->list);
-        list_add_head(&slab->list, &cache->part_slabs);
+        // 原先是满的要挪到 part 上，全空了挪到 free 上
+        obj_push(slab, obj);
+        list_del_init(&slab->list);
+        victim = slab_place(cache, slab);
     }
-    obj_push(slab, obj);
+    spin_unlock(&cache->lock);
+    if (victim)
+        slab_destory(victim);
+}
 
+// 把 cache 中空闲的 slab 全部还给伙伴系统，返回释放的页面数
+int kmem_cache_shrink(struct kmem_cache *cache)
+{
+    struct list_head head;
+
+    INIT_LIST_HEAD(&head);
+    spin_lock(&cache->lock);
+    take_free_slabs(cache, &head);
     spin_unlock(&cache->lock);
+    return destory_slab_list(&head);
 }
 
+// 伙伴系统空闲页面不够时调用：回收所有缓存中空闲的 slab，返回释放的页面数
+// 可能是在某个缓存加锁新建 slab 时调用的，因此都只是尝试加锁，拿不到就跳过
+int kmem_cache_shrink_all()
+{
+    struct kmem_cache *cache;
+    struct list_head head;
+
+    if (atomic_read(&nr_free_slabs) == 0)
+        return 0;
+
+    INIT_LIST_HEAD(&head);
+    if (!spin_trylock(&kmem_cache_list_lock))
+        return 0;
+    list_for_each_entry(cache, &kmem_cache_list, list)
+    {
+        if (!spin_trylock(&cache->lock))
+            continue;
+        take_free_slabs(cache, &head);
+        spin_unlock(&cache->lock);
+    }
+    spin_unlock(&kmem_cache_list_lock);
+    return destory_slab_list(&head);
+}
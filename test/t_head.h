@@ -11,6 +11,8 @@ extern void sleep_test();      // 睡眠锁
 
 extern void hash_test();       // 哈希表
 
+extern void rbtree_test();     // 红黑树
+
 extern void buf_test();        // 缓冲区
 
 extern void block_func_test();  // 块设备测试
@@ -1,11 +1,32 @@
 #include "mm/slab.h"
+#include "mm/kmalloc.h"
+#include "mm/page.h"
 #include "std/stdio.h"
+#include "lib/string.h"
+
+// 不同大小的 kmalloc：分级的小对象和直接走伙伴系统的大块
+static void kmalloc_size_test()
+{
+    void *small = kmalloc(130, 0);
+    void *large = kmalloc(5 * PGSIZE, 0);
+
+    assert(small && large, "kmalloc_size_test: allocation failed\n");
+    assert(TestPageFlag(get_page_struct((uint64)small), PG_Slab), "kmalloc_size_test: small not from slab\n");
+    assert(get_page_struct((uint64)large)->order == 3, "kmalloc_size_test: large order\n");
+    memset(large, 0x5a, 5 * PGSIZE);
+    kfree(small);
+    kfree(large);
+    assert(!TestPageFlag(get_page_struct((uint64)large), PG_large), "kmalloc_size_test: PG_large not cleared\n");
+    printk("kmalloc_size_test ok\n");
+}
+
 void kmem_cache_test()
 {
+    kmalloc_size_test();
 
     // 创建一个 kmem_cache 对象，用于分配大小为 17 字节的对象
     struct kmem_cache things;
-    kmem_cache_create(&things, "things", 8192, 0);
+    kmem_cache_create(&things, "things", 8192, 0, NULL);
 
     // // 分配多个对象
     void *a1 = kmem_cache_alloc(&things);
@@ -1,92 +1,86 @@
-// #include "mm/mm.h"
-// #include "mm/buddy.h"
-// #include "std/stdio.h"
-// extern struct buddy_struct buddy;
+#include "mm/mm.h"
+#include "mm/buddy.h"
+#include "mm/page.h"
+#include "std/stdio.h"
+#include "lib/string.h"
 
-// static void debug()
-// {
-//     for (int i = 0; i < MAX_LEVEL; i++)
-//     {
-//         uint len = list_len(&buddy.free_lists[i]);
-//         printk("{ L: %d, N: %d }\t", i, len);
-//     }
-//     printk("\n");
-// }
+#define NR_MOVABLE 8
+static void *movable[NR_MOVABLE];
 
-// void mm_test()
-// {
-//     // Step 1: 初始化内存管理系统
-//     mem_init();
-//     printk("Initial memory state:\n");
-//     debug();
-//     printk("-------------OK\n");
+// 测试用的搬迁函数：private 指向 movable 数组中保存页面地址的槽
+static int test_migrate(struct page *from, struct page *to)
+{
+    void **slot = (void **)from->private;
 
-//     // Step 2: 边界测试 - 单页分配和释放
-//     printk("Test Case 1: Single page allocation and deallocation\n");
-//     debug();
-//     struct page *addr1 = alloc_page(0); // 分配 1 页
-//     debug();
-//     free_page(addr1); // 释放
-//     debug();
-//     printk("-------------OK\n");
+    memcpy((void *)get_page_addr(to), (void *)get_page_addr(from), PGSIZE);
+    *slot = (void *)get_page_addr(to);
+    page_set_movable(to, test_migrate, slot);
+    return 0;
+}
 
-//     // Step 3: 多页分配（2^n 页）测试
-//     printk("Test Case 2: Allocating and freeing multiple pages (order = 3)\n");
-//     debug();
-//     struct page *addr2 = alloc_pages(0, 3);
-//     debug();
-//     free_pages(addr2, 3);
-//     debug();
-//     printk("-------------OK\n");
+// 单页走每个 CPU 的缓存，不会马上回到伙伴系统，这里主要测多页的拆分与合并
 
-//     // Step 4: 非对齐分配（非 2^n 页）模拟
-//     printk("Test Case 3: Simulating non-power-of-2 allocation by splitting and combining\n");
-//     debug();
-//     struct page *addr3a = alloc_page(0);
-//     debug();
-//     struct page *addr3b = alloc_pages(0, 2);
-//     debug();
-//     free_page(addr3a);
-//     debug();
-//     free_pages(addr3b, 2);
-//     debug();
-//     printk("-------------OK\n");
+void mm_test()
+{
+    struct page *a, *b, *c, *big;
+    int i;
 
-//     // Step 5: 连续分配多次，释放时乱序
-//     printk("Test Case 4: Consecutive allocation and random-order freeing\n");
-//     struct page *addr4a = alloc_pages(0, 4); // 分配 16 页 (2^4)
-//     struct page *addr4b = alloc_pages(0, 3); // 分配 8 页 (2^3)
-//     struct page *addr4c = alloc_page(0);     // 分配 1 页
-//     debug();
-//     free_pages(addr4b, 3); // 乱序释放 8 页
-//     debug();
-//     free_pages(addr4a, 4); // 乱序释放 16 页
-//     debug();
-//     free_page(addr4c); // 乱序释放 1 页
-//     debug();
-//     printk("-------------OK\n");
+    printk("Initial memory state:\n");
+    buddy_info();
 
-//     // Step 6: 分配大块内存（接近总内存大小）
-//     printk("Test Case 5: Allocating almost all memory (largest block)\n");
-//     struct page *addr5 = alloc_pages(0, MAX_LEVEL - 1); // 分配最大块
-//     debug();
-//     free_pages(addr5, MAX_LEVEL - 1); // 释放最大块
-//     debug();
-//     printk("-------------OK\n");
+    // 多页分配（2^n 页）
+    printk("Test Case 1: Allocating and freeing multiple pages (order = 3)\n");
+    a = alloc_pages(0, 3);
+    assert(a != NULL, "mm_test: alloc order 3\n");
+    assert(((a - mem_map.pages) & 7) == 0, "mm_test: order 3 block not aligned\n");
+    buddy_info();
+    free_pages(a, 3);
+    buddy_info();
+    printk("-------------OK\n");
 
-//     // // Step 7: 多级合并测试
-//     printk("Test Case 6: Testing multi-level merging\n");
-//     struct page *addr6a = alloc_pages(0, 2); // 分配 4 页 (2^2)
-//     debug();
-//     struct page *addr6b = alloc_pages(0, 2); // 分配 4 页
-//     debug();
-//     struct page *addr6c = alloc_pages(0, 2); // 分配 4 页
-//     debug();
-//     free_pages(addr6a, 2); // 释放第一个块
-//     free_pages(addr6b, 2); // 释放第二个块，触发合并
-//     free_pages(addr6c, 2); // 释放第三个块，触发多级合并
-//     debug();
-//     printk("-------------OK\n");
+    // 连续分配多次，释放时乱序
+    printk("Test Case 2: Consecutive allocation and random-order freeing\n");
+    a = alloc_pages(0, 4);
+    b = alloc_pages(0, 3);
+    c = alloc_pages(0, 1);
+    free_pages(b, 3);
+    free_pages(a, 4);
+    free_pages(c, 1);
+    buddy_info();
+    printk("-------------OK\n");
 
-//     printk(" :-) \n");
-// }
\ No newline at end of file
+    // 多级合并：把一个最大块当成许多 order 2 的块，乱序释放后必须正好合并回最大块
+    printk("Test Case 3: Testing multi-level merging\n");
+    big = alloc_pages(0, MAX_LEVEL_INDEX);
+    assert(big != NULL, "mm_test: alloc max order\n");
+    for (i = 1; i < MAX_LEVEL_COUNT / 4; i++)
+        page_push(big + i * 4);
+    for (i = 1; i < MAX_LEVEL_COUNT / 4; i += 2)
+        free_pages(big + i * 4, 2);
+    for (i = 0; i < MAX_LEVEL_COUNT / 4; i += 2)
+        free_pages(big + i * 4, 2);
+    assert(alloc_pages(0, MAX_LEVEL_INDEX) == big, "mm_test: max order block not merged\n");
+    free_pages(big, MAX_LEVEL_INDEX);
+    buddy_info();
+    printk("-------------OK\n");
+
+    // 内存整理：搬迁后可移动页面的内容不变
+    printk("Test Case 4: Compaction keeps movable page contents\n");
+    for (i = 0; i < NR_MOVABLE; i++)
+    {
+        movable[i] = __alloc_page(__GFP_MOVABLE);
+        assert(movable[i] != NULL, "mm_test: alloc movable #%d\n", i);
+        memset(movable[i], i + 1, PGSIZE);
+        page_set_movable(get_page_struct((uint64)movable[i]), test_migrate, &movable[i]);
+    }
+    compact_memory(MAX_LEVEL_INDEX);
+    for (i = 0; i < NR_MOVABLE; i++)
+    {
+        assert(((char *)movable[i])[PGSIZE - 1] == i + 1, "mm_test: movable page #%d corrupted\n", i);
+        __free_page(movable[i]);
+    }
+    buddy_info();
+    printk("-------------OK\n");
+
+    printk(" :-) \n");
+}
@@ -0,0 +1,96 @@
+#include "lib/rbtree.h"
+#include "mm/kmalloc.h"
+#include "std/stdio.h"
+
+struct rb_fox
+{
+    int key;
+    struct rb_node node;
+};
+
+static struct rb_root_cached fox_tree;
+
+static void fox_insert(struct rb_fox *f)
+{
+    struct rb_node **link = &fox_tree.root.node, *parent = NULL;
+    int leftmost = 1;
+    while (*link)
+    {
+        parent = *link;
+        if (f->key < rb_entry(parent, struct rb_fox, node)->key)
+            link = &parent->left;
+        else
+        {
+            link = &parent->right;
+            leftmost = 0;
+        }
+    }
+    rb_link_node(&f->node, parent, link);
+    rb_insert_color_cached(&f->node, &fox_tree, leftmost);
+}
+
+// 检查红黑树性质，返回黑高，出错返回 -1
+static int rb_check(struct rb_node *node, struct rb_node *parent)
+{
+    int l, r;
+    if (!node)
+        return 1;
+    if (node->parent != parent)
+        return -1;
+    if (node->color == RB_RED &&
+        ((node->left && node->left->color == RB_RED) || (node->right && node->right->color == RB_RED)))
+        return -1;
+    l = rb_check(node->left, node);
+    r = rb_check(node->right, node);
+    if (l < 0 || r < 0 || l != r)
+        return -1;
+    return l + (node->color == RB_BLACK);
+}
+
+void rbtree_test()
+{
+    struct rb_fox *foxes[200];
+    struct rb_node *node;
+    int i, last, count;
+
+    fox_tree = RB_ROOT_CACHED;
+
+    // 乱序插入
+    for (i = 0; i < 200; i++)
+    {
+        foxes[i] = kmalloc(sizeof(struct rb_fox), 0);
+        foxes[i]->key = (i * 37) % 200;
+        fox_insert(foxes[i]);
+    }
+    printk("after insert: black height %d, first key %d\n",
+           rb_check(fox_tree.root.node, NULL),
+           rb_entry(rb_first_cached(&fox_tree), struct rb_fox, node)->key); // 应该为 0
+
+    // 删除一半
+    for (i = 0; i < 200; i += 2)
+    {
+        rb_erase_cached(&foxes[i]->node, &fox_tree);
+        kfree(foxes[i]);
+    }
+    printk("after erase: black height %d\n", rb_check(fox_tree.root.node, NULL)); // 不应该为 -1
+
+    // 中序遍历应该有序
+    last = -1;
+    count = 0;
+    for (node = rb_first_cached(&fox_tree); node; node = rb_next(node))
+    {
+        struct rb_fox *f = rb_entry(node, struct rb_fox, node);
+        if (f->key < last)
+            printk("rbtree_test: order error %d < %d\n", f->key, last);
+        last = f->key;
+        count++;
+    }
+    printk("in-order count: %d\n", count); // 应该为 100
+
+    for (i = 1; i < 200; i += 2)
+    {
+        rb_erase_cached(&foxes[i]->node, &fox_tree);
+        kfree(foxes[i]);
+    }
+    printk("empty: %d\n", RB_EMPTY_ROOT(&fox_tree.root)); // 应该为 1
+}